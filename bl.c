@@ -56,6 +56,7 @@
 
 #include "bl.h"
 #include "cdcacm.h"
+#include "sha256.h"
 #include "uart.h"
 
 // bootloader flash update protocol.
@@ -75,7 +76,8 @@
 // Expected workflow (protocol 3) is:
 //
 // GET_SYNC		verify that the board is present
-// GET_DEVICE		determine which board (select firmware to upload)
+// GET_DEVICE		determine which board (select firmware to upload),
+//			or GET_INFO for everything at once (revision 8, CAP_GET_INFO)
 // CHIP_ERASE		erase the program area and reset address counter
 // loop:
 //      PROG_MULTI      program bytes
@@ -104,8 +106,180 @@
 //								header above).
 //
 // BOOT							Finalize the programming and start the application.
-
-#define BL_PROTOCOL_VERSION 		7		// The revision of the bootloader protocol
+//
+//
+// Expected workflow with pipelined programming (revision 8) is:
+//
+// GET_SYNC
+// GET_DEVICE
+// GET_DEVICE/PROG_WINDOW	Number of PROG_SEQ packets that may be in flight (N)
+// CHIP_ERASE					Also resets the expected sequence number to 0
+// loop: PROG_SEQ				Send up to N packets before waiting for a reply.
+//								Each reply carries the next sequence number the
+//								board expects (a cumulative ack). A reply of
+//								INVALID means the packet was dropped because
+//								it was out of order; resend from the acked
+//								sequence number.
+// GET_CRC
+// BOOT
+//
+// Over links that corrupt data, use PROG_FRAME (CAP_PROG_FRAME) in place of
+// PROG_SEQ. Each frame carries a CRC and a corrupted frame is answered with
+// BAD_CRC without being programmed, so only that frame has to be resent.
+// GET_DEVICE/PROG_WINDOW applies to frames of up to 250 bytes of data.
+//
+// Hosts that do not pipeline should check GET_DEVICE/CAPS for PROG_LARGE
+// and use it with packets of up to GET_DEVICE/PROG_MAX bytes instead of
+// PROG_MULTI.
+//
+//
+// Expected workflow with compression (revision 8, CAP_PROG_LZ4) is:
+//
+// GET_SYNC
+// GET_DEVICE
+// CHIP_ERASE					Also resets the decompressor
+// loop: PROG_LZ4				Send the image, padded to a multiple of 4 bytes
+//								and compressed as a single LZ4 block, in chunks
+//								of up to GET_DEVICE/PROG_MAX bytes. Chunks may
+//								split LZ4 sequences anywhere.
+// GET_CRC
+// BOOT
+//
+//
+// Expected workflow with background jobs (revision 8, CAP_JOBS) is:
+//
+// GET_SYNC
+// GET_DEVICE
+// JOB_START ERASE				Replies at once and erases in the background
+// loop: GET_STATUS				Poll with a short timeout until the job is done,
+//								showing the progress.
+// loop: PROG_MULTI
+// JOB_START CRC
+// loop: GET_STATUS				The CRC is returned as the result of the job
+// BOOT
+//
+// Any other command waits for the running job to finish first.
+//
+//
+// Expected workflow to run test firmware from RAM (revision 8, CAP_RAM_LOAD) is:
+//
+// GET_SYNC
+// GET_DEVICE/RAM_WINDOW		The address and size of the RAM window. The image
+//								must be linked to run at that address and start
+//								with its vector table.
+// loop: LOAD_RAM				Copy the image into the window.
+// RUN_RAM						Check the CRC of the image and start it. The
+//								flash is left as it was.
+//
+//
+// Expected workflow for a delta update (revision 8, CAP_SECTOR_UPDATE) is:
+//
+// GET_SYNC
+// GET_DEVICE
+// loop: GET_SECTOR_CRC			Fetch the size and CRC of each sector until a
+//								size of 0 is returned, and compare them with
+//								the new image (padded with 0xff).
+// ERASE_SECTOR 0				Always first, so that the image cannot boot
+//								until the update is complete.
+// loop: PROG_MULTI				Reprogram sector 0.
+// loop: ERASE_SECTOR			For each other sector that differs, erase it,
+//      loop: PROG_MULTI		which moves the program address to its start,
+//								and reprogram it.
+// GET_CRC
+// BOOT
+//
+// Where the image has long runs of 0xff (erased flash), the host may use
+// PROG_ADDR (CAP_PROG_ADDR) to skip over them instead of sending them. The
+// first packet of the image must still be sent.
+//
+//
+// Expected workflow to update one partition (revision 8, CAP_PARTITIONS) is:
+//
+// GET_SYNC
+// GET_DEVICE
+// loop: GET_PARTITION			Fetch the name, place, size and CRC of each
+//								partition until a size of 0 is returned, and
+//								compare them with the new images (padded with
+//								0xff).
+// ERASE_PARTITION				For each partition that differs, erase it,
+//      loop: PROG_MULTI		which moves the program address to its start,
+//								and reprogram it.
+// GET_PARTITION				Check the new CRC of the partition.
+// BOOT
+//
+// Unlike ERASE_SECTOR, ERASE_PARTITION does not need the first sector to be
+// erased first, so the other partitions are left bootable. The app should
+// check its data partitions before it uses them.
+//
+//
+// Expected workflow to flash several boards on one bus (revision 8, CAP_MULTIDROP) is:
+//
+// BUS_SELECT ALL				Every node takes the following commands and none
+//								of them replies, so wait as long as the slowest
+//								node needs for each one.
+// CHIP_ERASE
+// loop: PROG_FRAME				The image goes to every node at once, in frames
+//								only, as the nodes refuse other program commands
+//								now. A node that misses a frame drops the ones
+//								after it as out of sequence, so nothing is
+//								programmed out of place.
+// loop: BUS_SELECT <udid>		For each node, by the UDID that GET_SN reads:
+//								the reply has the number of commands that failed,
+//								the program address and the CRC of the image up
+//								to it. Only that node replies until the next
+//								BUS_SELECT and the others ignore the traffic.
+//      loop: PROG_LARGE		Send the rest of the image from the reported
+//								address if it stopped short.
+//      GET_CRC
+// BUS_SELECT ALL
+// BOOT
+//
+//
+// Expected workflow to also flash a second MCU through this one (revision 8,
+// CAP_BRIDGE), such as px4io, is:
+//
+// GET_SYNC
+// GET_DEVICE
+// CHIP_ERASE, loop: PROG_MULTI, GET_CRC	Update this board as usual.
+// BRIDGE_START					Sync with the bootloader of the second MCU and
+//								erase it. It must be in its bootloader, so the
+//								host may need to retry while it is reset.
+// loop: BRIDGE_PROG			Send its image, padded to a multiple of 4 bytes,
+//								in chunks of up to GET_DEVICE/PROG_MAX bytes.
+//								Each chunk is passed on as PROG_MULTI packets.
+// BRIDGE_END					Check the CRC of the second MCU against the data
+//								sent and boot it.
+// BOOT
+//
+//
+// Expected workflow to speed up an upload over the USART (revision 8, CAP_SET_BAUD) is:
+//
+// GET_SYNC
+// SET_BAUD						Replies at the current rate, then switches.
+// GET_SYNC						Sent by the host at the new rate within 1s. If
+//								the board does not get it, it goes back to the
+//								old rate and the host should too.
+// CHIP_ERASE, loop: PROG_MULTI, GET_CRC
+// BOOT
+//
+// The rate holds until the board leaves the bootloader.
+//
+//
+// Expected workflow to resume an interrupted upload (revision 8, CAP_RESUME) is:
+//
+// GET_SYNC
+// GET_DEVICE
+// RESUME						Returns the verified program address and the CRC
+//								of the image up to it. If the command fails or
+//								the CRC does not match the image, start again
+//								with CHIP_ERASE.
+// loop: PROG_MULTI				Send the rest of the image from that address.
+//								PROG_SEQ numbering restarts at 0 and PROG_LZ4
+//								needs a new LZ4 block that starts there.
+// GET_CRC
+// BOOT
+
+#define BL_PROTOCOL_VERSION 		8		// The revision of the bootloader protocol
 // protocol bytes
 #define PROTO_INSYNC				0x12    // 'in sync' byte sent before status
 #define PROTO_EOC					0x20    // end of command
@@ -117,28 +291,53 @@
 #define PROTO_BAD_SILICON_REV 		0x14 	// On the F4 series there is an issue with < Rev 3 silicon
 // see https://pixhawk.org/help/errata
 #define PROTO_BAD_KEY				0x15 	// INSYNC/BAD_KEY - 'PROTO_PROG_MULTI_ENCRYPTED run with zeroed out Key'
+#define PROTO_BAD_CRC				0x16	// INSYNC/BAD_CRC - 'PROTO_PROG_FRAME received corrupted, resend it' (rev 8+)
 
 // Command bytes
 #define PROTO_GET_SYNC				0x21    // NOP for re-establishing sync
 #define PROTO_GET_DEVICE			0x22    // get device ID bytes
 #define PROTO_CHIP_ERASE			0x23    // erase program area and reset program address
+#define PROTO_PROG_ADDR				0x24    // like PROG_LARGE but at an explicit, later address (rev 8+)
+#define PROTO_PROG_LZ4				0x25    // like PROG_LARGE but the data is LZ4 compressed (rev 8+)
+#define PROTO_PROG_LARGE			0x26    // like PROG_MULTI but with a 16 bit length (rev 8+)
 #define PROTO_PROG_MULTI			0x27    // write bytes at program address and increment
+#define PROTO_PROG_SEQ				0x28    // like PROG_MULTI but sequence numbered, may be pipelined (rev 8+)
+#define PROTO_GET_SECTOR_CRC		0x32    // compute & return the CRC of one flash sector (rev 8+)
+#define PROTO_ERASE_SECTOR			0x33    // erase one flash sector and move the program address to it (rev 8+)
+#define PROTO_RESUME				0x34    // restore the program address of an interrupted upload (rev 8+)
+#define PROTO_GET_DIGEST			0x35    // compute & return a CRC or hash of a range of flash (rev 8+)
 #define PROTO_GET_CRC				0x29	// compute & return a CRC
 #define PROTO_GET_OTP				0x2a	// read a byte from OTP at the given address
 #define PROTO_GET_SN				0x2b    // read a word from UDID area ( Serial)  at the given address
 #define PROTO_GET_CHIP				0x2c    // read chip version (MCU IDCODE)
 #define PROTO_SET_DELAY				0x2d    // set minimum boot delay
 #define PROTO_GET_CHIP_DES			0x2e    // read chip version In ASCII
+#define PROTO_GET_INFO				0x2f    // read all the identification data at once (rev 8+)
 #define PROTO_BOOT					0x30    // boot the application
 #define PROTO_DEBUG					0x31    // emit debug information - format not defined
 
 #define PROTO_PROG_MULTI_MAX    255	// maximum PROG_MULTI size
-#define PROTO_READ_MULTI_MAX    255	// size of the size field
+#define PROTO_READ_MULTI_MAX    0xfffc	// largest READ_MULTI size, a multiple of 4 in the 16 bit length field
 
 #define PROTO_SET_IV				0x36	// send initialization vector (rev 6+)
 #define PROTO_PROG_MULTI_ENCRYPTED	0x37	// like PROG_MULTI but encrypted with AES-128 (rev 6+)
 #define PROTO_CHECK_CRC				0x38	// Check the CRC which is included in the last 4 bytes (rev 6+)
 #define PROTO_CHECK_KEY				0x39	// Check the Key is valid (not all 0s) (rev 7+)
+#define PROTO_PROG_FRAME			0x3a	// like PROG_SEQ but with a 16 bit length and a CRC (rev 8+)
+#define PROTO_JOB_START				0x3b	// start a long operation in the background (rev 8+)
+#define PROTO_GET_STATUS			0x3c	// report the progress of the background operation (rev 8+)
+#define PROTO_READ_MULTI			0x3d	// read bytes from flash, OTP or UDID (rev 8+)
+#define PROTO_VERIFY_BLOCKS			0x3e	// compare blocks of flash with a list of CRCs (rev 8+)
+#define PROTO_SET_VERIFY			0x3f	// choose when programmed data is read back (rev 8+)
+#define PROTO_LOAD_RAM				0x40	// copy bytes into the RAM window (rev 8+)
+#define PROTO_RUN_RAM				0x41	// check and start the image in the RAM window (rev 8+)
+#define PROTO_GET_PARTITION			0x42	// return the place, size and CRC of one partition (rev 8+)
+#define PROTO_ERASE_PARTITION		0x43	// erase one partition and move the program address to it (rev 8+)
+#define PROTO_BUS_SELECT			0x44	// choose which node on a shared bus replies (rev 8+)
+#define PROTO_BRIDGE_START			0x45	// sync with and erase the second MCU (rev 8+)
+#define PROTO_BRIDGE_PROG			0x46	// program bytes of the second MCU (rev 8+)
+#define PROTO_BRIDGE_END			0x47	// check and boot the second MCU (rev 8+)
+#define PROTO_SET_BAUD				0x48	// change the USART baud rate and flow control (rev 8+)
 
 
 /* argument values for PROTO_GET_DEVICE */
@@ -147,6 +346,69 @@
 #define PROTO_DEVICE_BOARD_REV	3	// board revision
 #define PROTO_DEVICE_FW_SIZE	4	// size of flashable area
 #define PROTO_DEVICE_VEC_AREA	5	// contents of reserved vectors 7-10
+#define PROTO_DEVICE_PROG_WINDOW	6	// number of PROG_SEQ packets that may be in flight (rev 8+)
+#define PROTO_DEVICE_CAPS	7	// bitmask of PROTO_CAP_ optional commands (rev 8+)
+#define PROTO_DEVICE_PROG_MAX	8	// largest PROG_LARGE payload (rev 8+)
+#define PROTO_DEVICE_RAM_WINDOW	9	// address and size of the LOAD_RAM window (rev 8+)
+
+/* bits returned by PROTO_DEVICE_CAPS */
+#define PROTO_CAP_PROG_SEQ		(1 << 0)	// PROG_SEQ
+#define PROTO_CAP_PROG_LARGE	(1 << 1)	// PROG_LARGE
+#define PROTO_CAP_PROG_LZ4		(1 << 2)	// PROG_LZ4
+#define PROTO_CAP_SECTOR_UPDATE	(1 << 3)	// GET_SECTOR_CRC and ERASE_SECTOR
+#define PROTO_CAP_PROG_ADDR		(1 << 4)	// PROG_ADDR
+#define PROTO_CAP_RESUME		(1 << 5)	// RESUME
+#define PROTO_CAP_GET_INFO		(1 << 6)	// GET_INFO
+#define PROTO_CAP_GET_DIGEST	(1 << 7)	// GET_DIGEST with DIGEST_CRC32
+#define PROTO_CAP_SHA256		(1 << 8)	// GET_DIGEST with DIGEST_SHA256
+#define PROTO_CAP_PROG_FRAME	(1 << 9)	// PROG_FRAME
+#define PROTO_CAP_JOBS			(1 << 10)	// JOB_START and GET_STATUS
+#define PROTO_CAP_READ_MULTI	(1 << 11)	// READ_MULTI
+#define PROTO_CAP_VERIFY_BLOCKS	(1 << 12)	// VERIFY_BLOCKS
+#define PROTO_CAP_SET_VERIFY	(1 << 13)	// SET_VERIFY
+#define PROTO_CAP_RAM_LOAD		(1 << 14)	// LOAD_RAM and RUN_RAM
+#define PROTO_CAP_PARTITIONS	(1 << 15)	// GET_PARTITION and ERASE_PARTITION
+#define PROTO_CAP_MULTIDROP		(1 << 16)	// BUS_SELECT
+#define PROTO_CAP_BRIDGE		(1 << 17)	// BRIDGE_START, BRIDGE_PROG and BRIDGE_END
+#define PROTO_CAP_SET_BAUD		(1 << 18)	// SET_BAUD, only reported over the USART
+
+/* modes for PROTO_SET_VERIFY */
+#define PROTO_VERIFY_WORD		0	// read back each word as it is programmed (default)
+#define PROTO_VERIFY_PACKET		1	// read back the whole packet once it is programmed
+#define PROTO_VERIFY_NONE		2	// leave it to the final GET_CRC
+
+/* address spaces for PROTO_READ_MULTI */
+#define PROTO_SPACE_FLASH		0	// the app flash, as GET_CRC sees it
+#define PROTO_SPACE_OTP			1	// as GET_OTP
+#define PROTO_SPACE_UDID		2	// as GET_SN
+
+/* address for PROTO_BUS_SELECT that selects every node */
+#define PROTO_BUS_ALL			0xffffffff	// in all three words of the UDID
+
+/* flags for PROTO_SET_BAUD */
+#define PROTO_BAUD_FLOW			(1 << 0)	// RTS/CTS flow control, if the board has the pins
+
+#define PROTO_SET_BAUD_CONFIRM_MS	1000	// time for the host to confirm a new rate
+
+/* jobs for PROTO_JOB_START */
+#define PROTO_JOB_ERASE			1	// as CHIP_ERASE
+#define PROTO_JOB_CRC			2	// as GET_CRC
+
+/* job states returned by PROTO_GET_STATUS */
+#define PROTO_JOB_IDLE			0	// no job has been started
+#define PROTO_JOB_BUSY			1
+#define PROTO_JOB_DONE			2
+#define PROTO_JOB_FAILED		3
+
+/* algorithms for PROTO_GET_DIGEST */
+#define PROTO_DIGEST_CRC32		0	// as GET_CRC
+#define PROTO_DIGEST_SHA256		1	// SHA-256
+
+/* layout version of the GET_INFO reply */
+#define PROTO_INFO_VERSION		1
+
+/* largest PROG_SEQ command: opcode, sequence, length, data and EOC */
+#define PROTO_PROG_SEQ_FRAME_MAX	(1 + 2 + 1 + PROTO_PROG_MULTI_MAX + 1)
 
 #ifdef ENABLE_ENCRYPTION
 /* Provide a default key if none is provided on command line.
@@ -175,15 +437,124 @@
 #  endif
 #endif
 
+#if defined(ENABLE_RAM_LOAD)
+# if defined(ENABLE_ENCRYPTION)
+#  error ENABLE_RAM_LOAD would let an unencrypted image read the key
+# endif
+
+/* window for images loaded to RAM, from the linker script */
+extern uint8_t _ram_image_start[];
+extern uint8_t _ram_image_end[];
+#endif
+
+#if defined(ENABLE_SET_BAUD) && !INTERFACE_USART
+# error ENABLE_SET_BAUD needs INTERFACE_USART
+#endif
+
+/* a PROG_MAX payload behind the partial word held from the last packet */
 typedef union {
-	uint8_t		c[256];
-	uint32_t	w[64];
+	uint8_t		c[BOARD_FLASH_BUFFER_SIZE + 4];
+	uint32_t	w[BOARD_FLASH_BUFFER_SIZE / 4 + 1];
 } flash_buffer_t;
 
+static const uint32_t	bl_caps =
+#if defined(ENABLE_PROG_SEQ)
+				  PROTO_CAP_PROG_SEQ |
+#endif
+#if defined(ENABLE_PROG_FRAME)
+				  PROTO_CAP_PROG_FRAME |
+#endif
+#if defined(ENABLE_JOBS)
+				  PROTO_CAP_JOBS |
+#endif
+#if defined(ENABLE_READ_MULTI)
+				  PROTO_CAP_READ_MULTI |
+#endif
+#if defined(ENABLE_SET_VERIFY)
+				  PROTO_CAP_SET_VERIFY |
+#endif
+#if defined(ENABLE_GET_DIGEST)
+				  PROTO_CAP_GET_DIGEST |
+#endif
+#if defined(ENABLE_VERIFY_BLOCKS)
+				  PROTO_CAP_VERIFY_BLOCKS |
+#endif
+#if defined(ENABLE_SHA256)
+				  PROTO_CAP_SHA256 |
+#endif
+#if defined(ENABLE_LZ4)
+				  PROTO_CAP_PROG_LZ4 |
+#endif
+#if defined(ENABLE_SECTOR_UPDATE)
+				  PROTO_CAP_SECTOR_UPDATE |
+#endif
+#if defined(ENABLE_RESUME)
+				  PROTO_CAP_RESUME |
+#endif
+#if defined(ENABLE_GET_INFO)
+				  PROTO_CAP_GET_INFO |
+#endif
+#if defined(ENABLE_RAM_LOAD)
+				  PROTO_CAP_RAM_LOAD |
+#endif
+#if defined(ENABLE_PARTITIONS)
+				  PROTO_CAP_PARTITIONS |
+#endif
+#if defined(ENABLE_MULTIDROP)
+				  PROTO_CAP_MULTIDROP |
+#endif
+#if defined(ENABLE_BRIDGE)
+				  PROTO_CAP_BRIDGE |
+#endif
+#if defined(ENABLE_SET_BAUD)
+				  PROTO_CAP_SET_BAUD |
+#endif
+#if defined(ENABLE_PROG_LARGE)
+				  PROTO_CAP_PROG_LARGE |
+#endif
+#if defined(ENABLE_PROG_ADDR)
+				  PROTO_CAP_PROG_ADDR |
+#endif
+				  0;
+
 
 static uint8_t bl_type;
 static uint8_t last_input;
 
+#if defined(ENABLE_MULTIDROP)
+# if !defined(ENABLE_PROG_FRAME)
+#  error ENABLE_MULTIDROP needs ENABLE_PROG_FRAME
+# endif
+
+/* who a node on a shared bus is talking to, set by PROTO_BUS_SELECT */
+static enum {
+	BUS_DIRECT,		/* not on a shared bus, or selected: normal replies */
+	BUS_ALL,		/* every node takes commands, none replies */
+	BUS_OTHER		/* another node is selected, ignore its traffic */
+} bus_state;
+
+static uint32_t bus_errors;	/* commands that failed since the last report */
+
+/* the last bytes heard while another node is selected, BUS_SELECT sized */
+static uint8_t bus_window[1 + 12 + 4 + 1];
+#endif
+
+/* PROTO_CAP_ bits for the port the host is on, SET_BAUD is USART only */
+static uint32_t
+session_caps(void)
+{
+	uint32_t caps = bl_caps;
+
+#if defined(ENABLE_SET_BAUD)
+
+	if (((bl_type == NONE) ? last_input : bl_type) != USART) {
+		caps &= ~PROTO_CAP_SET_BAUD;
+	}
+
+#endif
+	return caps;
+}
+
 inline void cinit(void *config, uint8_t interface)
 {
 #if INTERFACE_USB
@@ -209,6 +580,9 @@ inline void cfini(void)
 #if INTERFACE_USART
 	uart_cfini();
 #endif
+#if defined(ENABLE_BRIDGE)
+	bridge_cfini();
+#endif
 }
 inline int cin(void)
 {
@@ -243,6 +617,14 @@ inline int cin(void)
 
 inline void cout(uint8_t *buf, unsigned len)
 {
+#if defined(ENABLE_MULTIDROP)
+
+	// only the selected node may drive the bus
+	if (bus_state != BUS_DIRECT) {
+		return;
+	}
+
+#endif
 #if INTERFACE_USB
 
 	if (bl_type == USB) {
@@ -258,41 +640,32 @@ inline void cout(uint8_t *buf, unsigned len)
 
 #endif
 }
+inline bool cdone(void)
+{
+#if INTERFACE_USB
 
+	if (bl_type == USB) {
+		return usb_tx_done();
+	}
 
+#endif
+#if INTERFACE_USART
 
-static const uint32_t	bl_proto_rev = BL_PROTOCOL_VERSION;	// value returned by PROTO_DEVICE_BL_REV
-
-static unsigned head, tail;
-static uint8_t rx_buf[256];
-
-static enum led_state {LED_BLINK, LED_ON, LED_OFF} _led_state;
+	if (bl_type == USART) {
+		return uart_tx_done();
+	}
 
-void sys_tick_handler(void);
+#endif
+	return true;
+}
 
-void
-buf_put(uint8_t b)
-{
-	unsigned next = (head + 1) % sizeof(rx_buf);
 
-	if (next != tail) {
-		rx_buf[head] = b;
-		head = next;
-	}
-}
 
-int
-buf_get(void)
-{
-	int	ret = -1;
+static const uint32_t	bl_proto_rev = BL_PROTOCOL_VERSION;	// value returned by PROTO_DEVICE_BL_REV
 
-	if (tail != head) {
-		ret = rx_buf[tail];
-		tail = (tail + 1) % sizeof(rx_buf);
-	}
+static enum led_state {LED_BLINK, LED_ON, LED_OFF} _led_state;
 
-	return ret;
-}
+void sys_tick_handler(void);
 
 static void
 do_jump(uint32_t stacktop, uint32_t entrypoint)
@@ -306,6 +679,33 @@ do_jump(uint32_t stacktop, uint32_t entrypoint)
 	for (;;) ;
 }
 
+/* shut everything down and start the image with its vector table at base */
+static void
+boot_image(const uint32_t *base)
+{
+	/* just for paranoia's sake */
+	flash_lock();
+
+	/* kill the systick interrupt */
+	systick_interrupt_disable();
+	systick_counter_disable();
+
+	/* deinitialise the interface */
+	cfini();
+
+	/* reset the clock */
+	clock_deinit();
+
+	/* deinitialise the board */
+	board_deinit();
+
+	/* switch exception handlers to the application */
+	SCB_VTOR = (uint32_t)base;
+
+	/* extract the stack and entrypoint from the app vector table and go */
+	do_jump(base[0], base[1]);
+}
+
 void
 jump_to_app()
 {
@@ -331,36 +731,19 @@ jump_to_app()
 		return;
 	}
 
-	/* just for paranoia's sake */
-	flash_lock();
-
-	/* kill the systick interrupt */
-	systick_interrupt_disable();
-	systick_counter_disable();
-
-	/* deinitialise the interface */
-	cfini();
-
-	/* reset the clock */
-	clock_deinit();
-
-	/* deinitialise the board */
-	board_deinit();
-
-	/* switch exception handlers to the application */
-	SCB_VTOR = APP_LOAD_ADDRESS;
-
-	/* extract the stack and entrypoint from the app vector table and go */
-	do_jump(app_base[0], app_base[1]);
+	boot_image(app_base);
 }
 
 volatile unsigned timer[NTIMERS];
+static volatile uint32_t sys_ms;	/* milliseconds since the timer system started */
 
 void
 sys_tick_handler(void)
 {
 	unsigned i;
 
+	sys_ms++;
+
 	for (i = 0; i < NTIMERS; i++)
 		if (timer[i] > 0) {
 			timer[i]--;
@@ -381,6 +764,16 @@ delay(unsigned msec)
 		;
 }
 
+/* wait, for at most msec, until everything sent with cout() has gone out */
+static void
+cflush(unsigned msec)
+{
+	timer[TIMER_DELAY] = msec;
+
+	while (!cdone() && timer[TIMER_DELAY] > 0)
+		;
+}
+
 static void
 led_set(enum led_state state)
 {
@@ -437,6 +830,23 @@ bad_key_response(void)
 	cout(data, sizeof(data));
 }
 
+#if defined(ENABLE_PROG_FRAME)
+# if !defined(ENABLE_PROG_SEQ)
+#  error ENABLE_PROG_FRAME needs ENABLE_PROG_SEQ
+# endif
+
+static void
+bad_crc_response(void)
+{
+	uint8_t data[] = {
+		PROTO_INSYNC,	// "in sync"
+		PROTO_BAD_CRC	// "frame corrupted"
+	};
+
+	cout(data, sizeof(data));
+}
+#endif
+
 static void
 invalid_response(void)
 {
@@ -461,13 +871,65 @@ failure_response(void)
 
 static volatile unsigned cin_count;
 
+/*
+ * Receive timeouts are deadlines in microseconds, taken from the millisecond
+ * count and the position of the SysTick counter within the millisecond.
+ */
+#define CIN_FRAME_SLACK_US	200000	// allowance for host and transport latency per payload
+
+static uint32_t cin_deadline;
+
+static uint32_t
+time_us(void)
+{
+	uint32_t ms;
+	uint32_t count;
+	uint32_t reload = systick_get_reload();
+
+	// read again if the millisecond ticked over in between
+	do {
+		ms = sys_ms;
+		count = systick_get_value();
+	} while (ms != sys_ms);
+
+	return ms * 1000 + ((reload - count) * 1000) / (reload + 1);
+}
+
+static void
+cin_deadline_set(uint32_t usec)
+{
+	cin_deadline = time_us() + usec;
+}
+
+static bool
+cin_deadline_passed(void)
+{
+	return (int32_t)(time_us() - cin_deadline) >= 0;
+}
+
+/* time to receive one byte over the link in use, in microseconds */
+static uint32_t
+cin_byte_us(void)
+{
+#if INTERFACE_USART
+
+	if (last_input == USART) {
+		// start, 8 data and stop bits
+		return (10 * 1000000 + uart_get_baudrate() - 1) / uart_get_baudrate();
+	}
+
+#endif
+	// USB full speed
+	return 1;
+}
+
 static int
 cin_wait(unsigned timeout)
 {
 	int c = -1;
 
 	/* start the timeout */
-	timer[TIMER_CIN] = timeout;
+	cin_deadline_set(timeout * 1000);
 
 	do {
 		c = cin();
@@ -477,11 +939,76 @@ cin_wait(unsigned timeout)
 			break;
 		}
 
-	} while (timer[TIMER_CIN] > 0);
+	} while (!cin_deadline_passed());
 
 	return c;
 }
 
+/**
+ * Receive a payload straight into its buffer.
+ *
+ * Data already queued from USB is copied out of the packet ring a run at
+ * a time rather than a byte at a time through cin().
+ *
+ * The whole payload has one deadline, the time it takes to send over the
+ * link plus some slack, so a stalled sender is given up on quickly.
+ *
+ * @return 0 on success, -1 if the deadline passed
+ */
+static int
+cin_block(uint8_t *dst, unsigned len)
+{
+	cin_deadline_set(CIN_FRAME_SLACK_US + len * cin_byte_us());
+
+	while (len > 0) {
+#if INTERFACE_USB
+
+		if (bl_type == USB) {
+			unsigned n = usb_cin_block(dst, len);
+
+			if (n > 0) {
+				dst += n;
+				len -= n;
+				cin_count += n;
+				continue;
+			}
+		}
+
+#endif
+		int c = cin();
+
+		if (c >= 0) {
+			*dst++ = c;
+			len--;
+			cin_count++;
+
+		} else if (cin_deadline_passed()) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Read and drop what is left of a command refused for its length, so that
+ * its payload is not taken for commands.
+ *
+ * @param len number of bytes still to come
+ */
+static void
+cin_drain(unsigned len)
+{
+	cin_deadline_set(CIN_FRAME_SLACK_US + len * cin_byte_us());
+
+	while (len > 0 && !cin_deadline_passed()) {
+		if (cin() >= 0) {
+			len--;
+			cin_count++;
+		}
+	}
+}
+
 /**
  * Function to wait for EOC
  *
@@ -522,6 +1049,20 @@ cin_word(uint32_t *wp, unsigned timeout)
 	return 0;
 }
 
+static int
+cin_half(uint16_t *hp, unsigned timeout)
+{
+	int lo = cin_wait(timeout);
+	int hi = cin_wait(timeout);
+
+	if (lo < 0 || hi < 0) {
+		return -1;
+	}
+
+	*hp = lo | (hi << 8);
+	return 0;
+}
+
 static uint32_t
 crc32(const uint8_t *src, unsigned len, unsigned state)
 {
@@ -553,6 +1094,401 @@ crc32(const uint8_t *src, unsigned len, unsigned state)
 	return state;
 }
 
+#if defined(ENABLE_MULTIDROP)
+/**
+ * Watch the traffic to another node for a BUS_SELECT.
+ *
+ * Every byte is taken as the possible last one of a BUS_SELECT, so that a
+ * stray command byte in a payload cannot swallow the real one. The UDID
+ * CRC makes a false match in the payload unlikely.
+ *
+ * @return true if the bytes up to c are a whole BUS_SELECT, left in
+ *         bus_window for PROTO_BUS_SELECT
+ */
+static bool
+bus_watch(uint8_t c)
+{
+	uint32_t crc = 0;
+
+	for (unsigned i = 1; i < sizeof(bus_window); i++) {
+		bus_window[i - 1] = bus_window[i];
+	}
+
+	bus_window[sizeof(bus_window) - 1] = c;
+
+	if (bus_window[0] != PROTO_BUS_SELECT || c != PROTO_EOC) {
+		return false;
+	}
+
+	for (unsigned i = 0; i < 4; i++) {
+		crc |= (uint32_t)bus_window[1 + 12 + i] << (i * 8);
+	}
+
+	return crc32(&bus_window[1], 12, 0) == crc;
+}
+#endif
+
+#if defined(ENABLE_ERASED_CRC)
+/*
+ * Feeding a byte to the CRC is an affine map of the state over GF(2):
+ * column i of m is the effect of state bit i, and v is the effect of the
+ * byte itself.
+ */
+typedef struct {
+	uint32_t	m[32];
+	uint32_t	v;
+} crc_op_t;
+
+static uint32_t
+crc_op_linear(const crc_op_t *op, uint32_t state)
+{
+	uint32_t result = 0;
+
+	for (unsigned i = 0; state != 0; i++, state >>= 1) {
+		if (state & 1) {
+			result ^= op->m[i];
+		}
+	}
+
+	return result;
+}
+
+/**
+ * Extend a CRC over len bytes of erased flash.
+ *
+ * Rather than feeding in every byte, the map for a single 0xff byte is
+ * squared up to the size of the run, which takes time in log(len).
+ */
+static uint32_t
+crc32_erased(uint32_t len, uint32_t state)
+{
+	static const uint8_t bytes[2] = {0x00, 0xff};
+	static crc_op_t erased_byte;
+	crc_op_t op, sq;
+
+	if (len == 0) {
+		return state;
+	}
+
+	/* check whether we have built the map for one byte yet */
+	if (erased_byte.m[0] == 0) {
+		erased_byte.v = crc32(&bytes[1], 1, 0);
+
+		for (unsigned i = 0; i < 32; i++) {
+			erased_byte.m[i] = crc32(&bytes[0], 1, 1u << i);
+		}
+	}
+
+	op = erased_byte;
+
+	while (len != 0) {
+		if (len & 1) {
+			state = crc_op_linear(&op, state) ^ op.v;
+		}
+
+		len >>= 1;
+
+		if (len != 0) {
+			for (unsigned i = 0; i < 32; i++) {
+				sq.m[i] = crc_op_linear(&op, op.m[i]);
+			}
+
+			sq.v = crc_op_linear(&op, op.v) ^ op.v;
+			op = sq;
+		}
+	}
+
+	return state;
+}
+#endif
+
+/**
+ * CRC of the image in [from, to), as GET_CRC computes it.
+ *
+ * @param first_word	deferred first word of the image, used in place of
+ *			the flash contents at offset 0 unless erased
+ */
+static uint32_t
+crc_range(uint32_t from, uint32_t to, uint32_t first_word, uint32_t state)
+{
+	for (uint32_t p = from; p < to; p += 4) {
+		uint32_t bytes;
+
+		if ((p == 0) && (first_word != 0xffffffff)) {
+			bytes = first_word;
+
+		} else {
+			bytes = flash_func_read_word(p);
+		}
+
+		state = crc32((uint8_t *)&bytes, sizeof(bytes), state);
+	}
+
+	return state;
+}
+
+#if defined(ENABLE_PROG_SEQ)
+/**
+ * Number of PROG_SEQ packets the host may send ahead of the replies.
+ *
+ * USB data is collected into the packet ring from the interrupt handler
+ * while we are busy programming, so as many frames as fit in the ring may
+ * be queued. Any more are held off by NAK rather than lost. The USART is
+ * polled, so it gets no more than one.
+ */
+static uint32_t
+prog_window(void)
+{
+#if INTERFACE_USB
+
+	if (last_input == USB && usb_rx_size() > 2 * PROTO_PROG_SEQ_FRAME_MAX) {
+		return usb_rx_size() / PROTO_PROG_SEQ_FRAME_MAX;
+	}
+
+#endif
+	return 1;
+}
+#endif
+
+#if defined(ENABLE_SHA256)
+# if !defined(ENABLE_GET_DIGEST)
+#  error ENABLE_SHA256 needs ENABLE_GET_DIGEST
+# endif
+
+/* SHA-256 of the image in [from, to), with the first word as for crc_range */
+static void
+sha256_range(uint32_t from, uint32_t to, uint32_t first_word, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	sha256_t ctx;
+	uint32_t words[16];
+	unsigned n = 0;
+
+	sha256_init(&ctx);
+
+	for (uint32_t p = from; p < to; p += 4) {
+		if ((p == 0) && (first_word != 0xffffffff)) {
+			words[n++] = first_word;
+
+		} else {
+			words[n++] = flash_func_read_word(p);
+		}
+
+		// hash whole blocks at a time
+		if (n == 16 || p + 4 == to) {
+			sha256_update(&ctx, (uint8_t *)words, n * 4);
+			n = 0;
+		}
+	}
+
+	sha256_final(&ctx, digest);
+}
+#endif
+
+#if defined(ENABLE_GET_INFO)
+/**
+ * Send the geometry of the app sectors as runs of equally sized sectors.
+ *
+ * reply:	runs * (<count:4>/<size:4>)
+ *
+ * @param send	false to only count the runs
+ * @return the number of runs
+ */
+static uint32_t
+cout_geometry(bool send)
+{
+	uint32_t runs = 0;
+	uint32_t count = 0;
+	uint32_t size;
+
+	for (unsigned i = BOARD_FIRST_FLASH_SECTOR_TO_ERASE; ; i++) {
+		size = flash_func_sector_size(i);
+
+		if (count > 0 && size != flash_func_sector_size(i - 1)) {
+			if (send) {
+				cout_word(count);
+				cout_word(flash_func_sector_size(i - 1));
+			}
+
+			runs++;
+			count = 0;
+		}
+
+		if (size == 0) {
+			break;
+		}
+
+		count++;
+	}
+
+	return runs;
+}
+#endif
+
+#if defined(ENABLE_SECTOR_UPDATE)
+/**
+ * Locate an app sector.
+ *
+ * Sectors are numbered from the first one the app may use, which is
+ * BOARD_FIRST_FLASH_SECTOR_TO_ERASE in the board's sector table.
+ *
+ * @param sector	app sector number
+ * @param offset	returns the sector's offset from the start of the app
+ * @return the size of the sector within fw_size, 0 if there is no such sector
+ */
+static uint32_t
+sector_extent(unsigned sector, uint32_t *offset)
+{
+	uint32_t size;
+
+	*offset = 0;
+
+	for (unsigned i = 0; i < sector; i++) {
+		size = flash_func_sector_size(i + BOARD_FIRST_FLASH_SECTOR_TO_ERASE);
+
+		if (size == 0) {
+			return 0;
+		}
+
+		*offset += size;
+	}
+
+	size = flash_func_sector_size(sector + BOARD_FIRST_FLASH_SECTOR_TO_ERASE);
+
+	if (*offset >= board_info.fw_size) {
+		return 0;
+	}
+
+	if (size > board_info.fw_size - *offset) {
+		size = board_info.fw_size - *offset;
+	}
+
+	return size;
+}
+#endif
+
+#if defined(ENABLE_PARTITIONS)
+# if !defined(ENABLE_SECTOR_UPDATE)
+#  error ENABLE_PARTITIONS needs ENABLE_SECTOR_UPDATE
+# endif
+
+/* a named run of app sectors that can be updated on its own */
+typedef struct {
+	char		name[8];	/* NUL padded */
+	uint8_t		first;		/* first app sector */
+	uint8_t		sectors;	/* number of sectors, 0 for the rest of the app area */
+} partition_t;
+
+static const partition_t partitions[] = {
+#if defined(BOARD_PARTITIONS)
+	BOARD_PARTITIONS
+#else
+	{ "app", 0, 0 },
+#endif
+};
+
+/**
+ * Locate a partition.
+ *
+ * @param index		partition number
+ * @param offset	returns the partition's offset from the start of the app
+ * @param sectors	returns the number of sectors within fw_size
+ * @return the size of the partition within fw_size, 0 if there is no such partition
+ */
+static uint32_t
+partition_extent(unsigned index, uint32_t *offset, unsigned *sectors)
+{
+	uint32_t size = 0;
+	uint32_t sector_offset;
+
+	*offset = 0;
+	*sectors = 0;
+
+	if (index >= sizeof(partitions) / sizeof(partitions[0])) {
+		return 0;
+	}
+
+	const partition_t *p = &partitions[index];
+
+	while (p->sectors == 0 || *sectors < p->sectors) {
+		uint32_t sector_size = sector_extent(p->first + *sectors, &sector_offset);
+
+		if (sector_size == 0) {
+			break;
+		}
+
+		if (*sectors == 0) {
+			*offset = sector_offset;
+		}
+
+		size += sector_size;
+		(*sectors)++;
+	}
+
+	return size;
+}
+#endif
+
+#if defined(ENABLE_BRIDGE)
+/*
+ * Client for the bootloader of a second MCU on BOARD_BRIDGE_USART, which
+ * speaks this same protocol.
+ */
+#define BRIDGE_SYNC_TRIES	40		// GET_SYNC attempts, 50ms apart
+#define BRIDGE_PROG_CHUNK	252		// PROG_MULTI size, a multiple of 4
+#define BRIDGE_ERASE_MS		10000	// longest CHIP_ERASE of the second MCU
+#define BRIDGE_CRC_MS		2000	// longest GET_CRC of the second MCU
+
+static uint32_t bridge_fw_size;		/* flashable area of the second MCU */
+static uint32_t bridge_address;		/* next address to program there */
+static uint32_t bridge_crc;			/* CRC of the data sent there */
+
+static int
+bridge_cin_wait(unsigned timeout)
+{
+	uint32_t start = time_us();
+
+	do {
+		int c = bridge_cin();
+
+		if (c >= 0) {
+			return c;
+		}
+	} while ((time_us() - start) < timeout * 1000);
+
+	return -1;
+}
+
+/**
+ * Send a command to the second MCU and collect the reply.
+ *
+ * @param cmd		the command, including EOC
+ * @param reply		receives the reply data
+ * @param timeout	time in ms allowed for each byte of the reply
+ * @return true if the reply data arrived, followed by INSYNC/OK
+ */
+static bool
+bridge_command(const uint8_t *cmd, unsigned len, uint8_t *reply, unsigned reply_len, unsigned timeout)
+{
+	// drop anything left over from an earlier command
+	while (bridge_cin() >= 0)
+		;
+
+	bridge_cout((uint8_t *)cmd, len);
+
+	for (unsigned i = 0; i < reply_len; i++) {
+		int c = bridge_cin_wait(timeout);
+
+		if (c < 0) {
+			return false;
+		}
+
+		reply[i] = c;
+	}
+
+	return bridge_cin_wait(timeout) == PROTO_INSYNC && bridge_cin_wait(timeout) == PROTO_OK;
+}
+#endif
+
 #ifdef ENABLE_ENCRYPTION
 
 const encryption_key_t key = {
@@ -590,295 +1526,1560 @@ void zero_key()
 }
 #endif
 
-void
-bootloader(unsigned timeout)
+/* CRC of the image from 0 up to the program address */
+static uint32_t prog_crc;
+
+/* the flash above the program address is known to be erased */
+static bool prog_tail_erased;
+
+/* when prog_buffer() reads back what it programmed, a PROTO_VERIFY_ mode */
+static uint8_t verify_mode = PROTO_VERIFY_WORD;
+
+/* bytes of a partial word waiting for the rest of it to arrive */
+static uint8_t prog_pending[4];
+static unsigned prog_pending_len;
+
+#if defined(ENABLE_RESUME)
+/*
+ * Upload progress, kept in the backup registers so that it survives a
+ * reset. The check word is written last and only matches a complete set.
+ */
+#define PROGRESS_MAGIC		0x52534d31	// "RSM1"
+
+enum {
+	PROGRESS_CHECK,
+	PROGRESS_ADDRESS,
+	PROGRESS_CRC,
+	PROGRESS_FIRST_WORD,
+};
+
+static void
+progress_clear(void)
 {
-	bl_type = NONE; // The type of the bootloader, whether loading from USB or USART, will be determined by on what port the bootloader recevies its first valid command.
+	board_set_backup_reg(PROGRESS_CHECK, 0);
+}
 
-	uint32_t	address = board_info.fw_size;	/* force erase before upload will work */
-	uint32_t	first_word = 0xffffffff;
+static void
+progress_save(uint32_t address, uint32_t first_word)
+{
+	board_set_backup_reg(PROGRESS_ADDRESS, address);
+	board_set_backup_reg(PROGRESS_CRC, prog_crc);
+	board_set_backup_reg(PROGRESS_FIRST_WORD, first_word);
+	board_set_backup_reg(PROGRESS_CHECK, PROGRESS_MAGIC ^ address ^ prog_crc ^ first_word);
+}
 
-#ifdef ENABLE_ENCRYPTION
-	uint32_t num_to_flash = 0;
-	uint32_t crc32_sum = 0;
-	static flash_buffer_t encrypted_buffer;
-	static uint8_t iv[16] = {0};
-	static int8_t key_state = -1; // -1: not initialized, 0: key valid, 1: key invalid
+/**
+ * Restore the progress of an interrupted upload.
+ *
+ * The saved CRC is checked against the flash, so the restored address
+ * is known to follow an intact, verified part of the image.
+ *
+ * @return 0 on success, -1 if there is nothing valid to resume
+ */
+static int
+progress_restore(uint32_t *address, uint32_t *first_word)
+{
+	uint32_t addr = board_get_backup_reg(PROGRESS_ADDRESS);
+	uint32_t crc = board_get_backup_reg(PROGRESS_CRC);
+	uint32_t word = board_get_backup_reg(PROGRESS_FIRST_WORD);
 
-	// The first 4 32bit words of the decrypted data contain CRC and number of bytes.
-	typedef struct __attribute__((packed)) {
-		uint32_t num_to_flash;
-		uint32_t crc32_sum;
-		uint32_t reserved1;
-		uint32_t reserved2;
-	} encryption_header_t;
-#endif
+	if (board_get_backup_reg(PROGRESS_CHECK) != (PROGRESS_MAGIC ^ addr ^ crc ^ word)) {
+		return -1;
+	}
 
-	/* (re)start the timer system */
-	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
-	systick_set_reload(board_info.systick_mhz * 1000);	/* 1ms tick, magic number */
-	systick_interrupt_enable();
-	systick_counter_enable();
+	if ((addr & 3) || addr > board_info.fw_size) {
+		return -1;
+	}
 
-	/* if we are working with a timeout, start it running */
-	if (timeout) {
-		timer[TIMER_BL_WAIT] = timeout;
+	// the first word is only written by BOOT
+	if (addr > 0 && flash_func_read_word(0) != 0xffffffff) {
+		return -1;
+	}
+
+	if (crc_range(0, addr, word, 0) != crc) {
+		return -1;
+	}
+
+	*address = addr;
+	*first_word = word;
+	prog_crc = crc;
+	return 0;
+}
+#endif
+
+/**
+ * Program a received buffer at the program address and advance it.
+ *
+ * The first word of the image is held back in first_word and only written
+ * by BOOT, so an interrupted upload never leaves a bootable image behind.
+ *
+ * @param address	program address, advanced by the number of bytes written
+ * @param first_word	deferred first word of the image
+ * @param buf		data to program, modified if it holds the first word
+ * @param len		number of bytes in buf, a multiple of 4
+ * @return 0 on success, -1 if the read-back did not match
+ */
+static int
+prog_buffer(uint32_t *address, uint32_t *first_word, flash_buffer_t *buf, unsigned len)
+{
+	if (*address == 0) {
+#if defined(ENABLE_ENCRYPTION)
+		// An unencrypted Download is Ok to do
+		// But the Key will be Zeroed out.
+		// This will then void the warranty on this unit.
+		zero_key();
+#endif
+		// save the first word and don't program it until everything else is done
+		*first_word = buf->w[0];
+		// replace first word with bits we can overwrite later
+		buf->w[0] = 0xffffffff;
 	}
 
-	/* make the LED blink while we are idle */
-	led_set(LED_BLINK);
-#ifdef ENABLE_ENCRYPTION
-	key_state = validate_key();
-#endif
+	uint32_t start = *address;
+
+	len /= 4;
+
+	for (unsigned i = 0; i < len; i++) {
+
+		// program the word
+		flash_func_write_word(*address, buf->w[i]);
+
+		// do immediate read-back verify
+		if (verify_mode == PROTO_VERIFY_WORD && flash_func_read_word(*address) != buf->w[i]) {
+			prog_tail_erased = false;
+			return -1;
+		}
+
+		uint32_t bytes = (*address == 0) ? *first_word : buf->w[i];
+		prog_crc = crc32((uint8_t *)&bytes, sizeof(bytes), prog_crc);
+
+		*address += 4;
+	}
+
+	switch (verify_mode) {
+	case PROTO_VERIFY_PACKET:
+
+		// read back the burst, off the programming path
+		for (unsigned i = 0; i < len; i++) {
+			if (flash_func_read_word(start + i * 4) != buf->w[i]) {
+				prog_tail_erased = false;
+				return -1;
+			}
+		}
+
+		break;
+
+	case PROTO_VERIFY_NONE:
+		// prog_crc is of what was sent, not of the flash, so GET_CRC must
+		// read the flash to check it
+		prog_tail_erased = false;
+		break;
+	}
+
+#if defined(ENABLE_RESUME)
+	progress_save(*address, *first_word);
+#endif
+	return 0;
+}
+
+#if defined(ENABLE_LZ4)
+/*
+ * Streaming LZ4 block decoder for PROG_LZ4.
+ *
+ * Decoded bytes are staged in the flash buffer and programmed as it fills,
+ * so the decoder needs no window of its own: a match that reaches back
+ * past the staged bytes is read back out of flash. The odd bytes left at
+ * the end of a chunk are kept aside, as other commands use the buffer.
+ */
+enum lz4_state {
+	LZ4_TOKEN,			// expecting a sequence token
+	LZ4_LITERAL_LEN,	// expecting more literal length bytes
+	LZ4_LITERALS,		// copying literals
+	LZ4_OFFSET_LO,		// expecting the match offset
+	LZ4_OFFSET_HI,
+	LZ4_MATCH_LEN,		// expecting more match length bytes
+};
+
+static struct {
+	enum lz4_state	state;
+	uint8_t		token;
+	uint32_t	count;		// literal or match bytes left in this sequence
+	uint32_t	offset;
+	unsigned	fill;		// decoded bytes staged in the flash buffer
+	uint8_t		tail[4];	// the staged bytes between chunks
+} lz4;
+
+static void
+lz4_reset(void)
+{
+	lz4.state = LZ4_TOKEN;
+	lz4.fill = 0;
+}
+
+/* fetch a byte that has already been decoded */
+static uint8_t
+lz4_byte(uint32_t pos, uint32_t address, uint32_t first_word, const flash_buffer_t *out)
+{
+	if (pos >= address) {
+		return out->c[pos - address];
+	}
+
+	uint32_t word = (pos < 4) ? first_word : flash_func_read_word(pos & ~3);
+
+	return word >> ((pos & 3) * 8);
+}
+
+static int
+lz4_emit(uint8_t b, uint32_t *address, uint32_t *first_word, flash_buffer_t *out)
+{
+	if ((*address + lz4.fill) >= board_info.fw_size) {
+		return -1;
+	}
+
+	out->c[lz4.fill++] = b;
+
+	if (lz4.fill == sizeof(out->c)) {
+		lz4.fill = 0;
+		return prog_buffer(address, first_word, out, sizeof(out->c));
+	}
+
+	return 0;
+}
+
+static int
+lz4_match(uint32_t *address, uint32_t *first_word, flash_buffer_t *out)
+{
+	if (lz4.offset == 0 || lz4.offset > (*address + lz4.fill)) {
+		return -1;
+	}
+
+	while (lz4.count > 0) {
+		uint32_t pos = *address + lz4.fill - lz4.offset;
+
+		if (lz4_emit(lz4_byte(pos, *address, *first_word, out), address, first_word, out)) {
+			return -1;
+		}
+
+		lz4.count--;
+	}
+
+	lz4.state = LZ4_TOKEN;
+	return 0;
+}
+
+/**
+ * Decode a chunk of the compressed stream, then program whatever whole
+ * words it produced.
+ *
+ * @return 0 on success, -1 on a corrupt stream, overrun or read-back failure
+ */
+static int
+lz4_decode(const uint8_t *src, unsigned len, uint32_t *address, uint32_t *first_word, flash_buffer_t *out)
+{
+	for (unsigned i = 0; i < lz4.fill; i++) {
+		out->c[i] = lz4.tail[i];
+	}
+
+	for (unsigned i = 0; i < len; i++) {
+		uint8_t b = src[i];
+
+		switch (lz4.state) {
+		case LZ4_TOKEN:
+			lz4.token = b;
+			lz4.count = b >> 4;
+			lz4.state = (lz4.count == 15) ? LZ4_LITERAL_LEN : LZ4_LITERALS;
+			break;
+
+		case LZ4_LITERAL_LEN:
+			lz4.count += b;
+
+			if (b != 255) {
+				lz4.state = LZ4_LITERALS;
+			}
+
+			break;
+
+		case LZ4_LITERALS:
+			if (lz4_emit(b, address, first_word, out)) {
+				return -1;
+			}
+
+			lz4.count--;
+			break;
+
+		case LZ4_OFFSET_LO:
+			lz4.offset = b;
+			lz4.state = LZ4_OFFSET_HI;
+			break;
+
+		case LZ4_OFFSET_HI:
+			lz4.offset |= b << 8;
+			lz4.count = (lz4.token & 0x0f) + 4;
+
+			if ((lz4.token & 0x0f) == 0x0f) {
+				lz4.state = LZ4_MATCH_LEN;
+
+			} else if (lz4_match(address, first_word, out)) {
+				return -1;
+			}
+
+			break;
+
+		case LZ4_MATCH_LEN:
+			lz4.count += b;
+
+			if (b != 255 && lz4_match(address, first_word, out)) {
+				return -1;
+			}
+
+			break;
+		}
+
+		// literals are always followed by a match offset
+		if (lz4.state == LZ4_LITERALS && lz4.count == 0) {
+			lz4.state = LZ4_OFFSET_LO;
+		}
+	}
+
+	// program the whole words and keep any odd bytes for the next chunk
+	unsigned whole = lz4.fill & ~3;
+
+	if (whole > 0 && prog_buffer(address, first_word, out, whole)) {
+		return -1;
+	}
+
+	lz4.fill -= whole;
+
+	for (unsigned i = 0; i < lz4.fill; i++) {
+		lz4.tail[i] = out->c[whole + i];
+	}
+
+	return 0;
+}
+#endif
+
+/**
+ * Program a pending partial word, padded with 0xff.
+ *
+ * @return 0 on success or if there was nothing pending, -1 if a PROG_LZ4
+ *	   stream stopped part way through a word, else as prog_buffer()
+ */
+static int
+prog_flush(uint32_t *address, uint32_t *first_word, flash_buffer_t *buf)
+{
+#if defined(ENABLE_LZ4)
+
+	// the stream must decode to whole words, so this image is short
+	if (lz4.fill != 0) {
+		return -1;
+	}
+
+#endif
+
+	if (prog_pending_len == 0) {
+		return 0;
+	}
+
+	buf->w[0] = 0xffffffff;
+
+	for (unsigned i = 0; i < prog_pending_len; i++) {
+		buf->c[i] = prog_pending[i];
+	}
+
+	prog_pending_len = 0;
+	return prog_buffer(address, first_word, buf, 4);
+}
+
+/* get ready to erase the flash: nothing may be programmed until it is verified */
+static void
+erase_begin(uint32_t *address)
+{
+	*address = board_info.fw_size;
+	prog_tail_erased = false;
+#if defined(ENABLE_RESUME)
+	progress_clear();
+#endif
+	// clear the bootloader LED while erasing - it stops blinking at random
+	// and that's confusing
+	led_set(LED_ON);
+	flash_unlock();
+}
+
+/* start programming over at the bottom of the erased and verified flash */
+static void
+erase_end(uint32_t *address, uint32_t *first_word, uint16_t *prog_seq)
+{
+	*address = 0;
+	prog_crc = 0;
+	prog_tail_erased = true;
+	*prog_seq = 0;
+	prog_pending_len = 0;
+#if defined(ENABLE_LZ4)
+	lz4_reset();
+#endif
+#if defined(ENABLE_RESUME)
+	progress_save(*address, *first_word);
+#endif
+
+	// resume blinking
+	led_set(LED_BLINK);
+}
+
+#if defined(ENABLE_JOBS)
+/*
+ * Long operations run as jobs, a step at a time while the bootloader waits
+ * for the next command, so that the host can poll them with GET_STATUS.
+ */
+#define JOB_CHUNK	4096	// bytes verified or summed per step
+
+static struct {
+	uint8_t		kind;		// PROTO_JOB_ERASE or PROTO_JOB_CRC
+	uint8_t		state;		// PROTO_JOB_IDLE, _BUSY, _DONE or _FAILED
+	uint16_t	sector;		// next sector to erase
+	uint16_t	sectors;	// sectors to erase
+	uint32_t	pos;		// bytes verified or summed so far
+	uint32_t	result;		// CRC of a CRC job
+} job;
+
+static void
+job_start(uint8_t kind, uint32_t *address)
+{
+	job.kind = kind;
+	job.state = PROTO_JOB_BUSY;
+	job.sector = 0;
+	job.pos = 0;
+	job.result = 0;
+
+	if (kind == PROTO_JOB_ERASE) {
+		job.sectors = 0;
+
+		while (flash_func_sector_size(job.sectors) != 0) {
+			job.sectors++;
+		}
+
+		erase_begin(address);
+	}
+}
+
+/**
+ * Advance the running job by one sector or one chunk.
+ *
+ * The program state is reset here when an erase completes, whether or not
+ * anyone is waiting for it.
+ */
+static void
+job_step(uint32_t *address, uint32_t *first_word, uint16_t *prog_seq)
+{
+	uint32_t end = job.pos + JOB_CHUNK;
+
+	if (end > board_info.fw_size) {
+		end = board_info.fw_size;
+	}
+
+	switch (job.kind) {
+	case PROTO_JOB_ERASE:
+		if (job.sector < job.sectors) {
+			flash_func_erase_sector(job.sector++);
+
+			// enable the LED while verifying the erase
+			if (job.sector == job.sectors) {
+				led_set(LED_OFF);
+			}
+
+			return;
+		}
+
+		// verify the erase
+		for (; job.pos < end; job.pos += 4) {
+			if (flash_func_read_word(job.pos) != 0xffffffff) {
+				job.state = PROTO_JOB_FAILED;
+				return;
+			}
+		}
+
+		if (job.pos == board_info.fw_size) {
+			erase_end(address, first_word, prog_seq);
+			job.state = PROTO_JOB_DONE;
+		}
+
+		break;
+
+	case PROTO_JOB_CRC:
+#if defined(ENABLE_ERASED_CRC)
+
+		// after a plain upload only the erased tail is left to add
+		if (job.pos == 0 && prog_tail_erased) {
+			job.result = crc32_erased(board_info.fw_size - *address, prog_crc);
+			end = board_info.fw_size;
+
+		} else
+#endif
+		{
+			job.result = crc_range(job.pos, end, *first_word, job.result);
+		}
+
+		job.pos = end;
+
+		if (job.pos == board_info.fw_size) {
+			job.state = PROTO_JOB_DONE;
+		}
+
+		break;
+	}
+}
+
+static void
+job_finish(uint32_t *address, uint32_t *first_word, uint16_t *prog_seq)
+{
+	while (job.state == PROTO_JOB_BUSY) {
+		job_step(address, first_word, prog_seq);
+	}
+}
+
+/* percentage of the running job that is done */
+static uint8_t
+job_percent(void)
+{
+	uint32_t percent = job.pos / (board_info.fw_size / 100);
+
+	if (job.kind == PROTO_JOB_ERASE) {
+		// erasing and verifying count half each
+		percent = (job.sector * 50) / job.sectors + percent / 2;
+	}
+
+	return (percent > 100) ? 100 : percent;
+}
+#endif
+
+void
+bootloader(unsigned timeout)
+{
+	bl_type = NONE; // The type of the bootloader, whether loading from USB or USART, will be determined by on what port the bootloader recevies its first valid command.
+
+	uint32_t	address = board_info.fw_size;	/* force erase before upload will work */
+	uint32_t	first_word = 0xffffffff;
+	uint16_t	prog_seq = 0;			/* next PROG_SEQ sequence number expected */
+
+#ifdef ENABLE_ENCRYPTION
+	uint32_t num_to_flash = 0;
+	uint32_t crc32_sum = 0;
+	static uint8_t iv[16] = {0};
+	static int8_t key_state = -1; // -1: not initialized, 0: key valid, 1: key invalid
+
+	// The first 4 32bit words of the decrypted data contain CRC and number of bytes.
+	typedef struct __attribute__((packed)) {
+		uint32_t num_to_flash;
+		uint32_t crc32_sum;
+		uint32_t reserved1;
+		uint32_t reserved2;
+	} encryption_header_t;
+#endif
+
+	/* (re)start the timer system */
+	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
+	systick_set_reload(board_info.systick_mhz * 1000);	/* 1ms tick, magic number */
+	systick_interrupt_enable();
+	systick_counter_enable();
+
+	/* if we are working with a timeout, start it running */
+	if (timeout) {
+		timer[TIMER_BL_WAIT] = timeout;
+	}
+
+	/* make the LED blink while we are idle */
+	led_set(LED_BLINK);
+#ifdef ENABLE_ENCRYPTION
+	key_state = validate_key();
+#endif
+
+	while (true) {
+		int c;
+		int arg;
+		int seq;
+		bool framed;
+		uint32_t target;
+#if defined(ENABLE_PROG_FRAME)
+		uint32_t frame_crc;
+#endif
+		static flash_buffer_t flash_buffer;
+#if defined(ENABLE_LZ4) || defined(ENABLE_ENCRYPTION)
+		static flash_buffer_t input_buffer;	/* payload that is decoded into flash_buffer */
+#endif
+
+		// Wait for a command byte
+		led_off(LED_ACTIVITY);
+
+		do {
+			/* if we have a timeout and the timer has expired, return now */
+			if (timeout && !timer[TIMER_BL_WAIT]) {
+				return;
+			}
+
+			/* try to get a byte from the host */
+			c = cin_wait(0);
+
+#if defined(ENABLE_JOBS)
+
+			/*
+			 * get on with the background job while the host is quiet,
+			 * once the last reply is out so a flash stall cannot hold it
+			 */
+			if (c < 0 && job.state == PROTO_JOB_BUSY && cdone()) {
+				job_step(&address, &first_word, &prog_seq);
+			}
+
+#endif
+		} while (c < 0);
+
+		led_on(LED_ACTIVITY);
+
+		// not a sequenced command (yet)
+		seq = -1;
+
+#if defined(ENABLE_MULTIDROP)
+
+		// while another node is selected, its commands and replies are not for us
+		if (bus_state == BUS_OTHER) {
+			if (!bus_watch(c)) {
+				continue;
+			}
+
+			c = PROTO_BUS_SELECT;
+		}
+
+#endif
+
+#if defined(ENABLE_JOBS)
+
+		// let a background job finish before anything else touches the flash
+		if (c != PROTO_GET_STATUS && c != PROTO_GET_SYNC) {
+			job_finish(&address, &first_word, &prog_seq);
+		}
+
+#endif
+
+		// handle the command byte
+		switch (c) {
+
+		// sync
+		//
+		// command:		GET_SYNC/EOC
+		// reply:		INSYNC/OK
+		//
+		case PROTO_GET_SYNC:
+
+			/* expect EOC */
+			if (!wait_for_eoc(2)) {
+				goto cmd_bad;
+			}
+
+			break;
+
+		// get device info
+		//
+		// command:		GET_DEVICE/<arg:1>/EOC
+		// BL_REV reply:	<revision:4>/INSYNC/EOC
+		// BOARD_ID reply:	<board type:4>/INSYNC/EOC
+		// BOARD_REV reply:	<board rev:4>/INSYNC/EOC
+		// FW_SIZE reply:	<firmware size:4>/INSYNC/EOC
+		// VEC_AREA reply	<vectors 7-10:16>/INSYNC/EOC
+		// PROG_WINDOW reply:	<packets:4>/INSYNC/EOC
+		// CAPS reply:		<PROTO_CAP_ bits:4>/INSYNC/EOC
+		// PROG_MAX reply:	<bytes:4>/INSYNC/EOC
+		// RAM_WINDOW reply:	<address:4>/<size:4>/INSYNC/EOC
+		// bad arg reply:	INSYNC/INVALID
+		//
+		case PROTO_GET_DEVICE:
+			/* expect arg then EOC */
+			arg = cin_wait(1000);
+
+			if (arg < 0) {
+				goto cmd_bad;
+			}
+
+			if (!wait_for_eoc(2)) {
+				goto cmd_bad;
+			}
+
+			switch (arg) {
+			case PROTO_DEVICE_BL_REV:
+				cout((uint8_t *)&bl_proto_rev, sizeof(bl_proto_rev));
+				break;
+
+			case PROTO_DEVICE_BOARD_ID:
+				cout((uint8_t *)&board_info.board_type, sizeof(board_info.board_type));
+				break;
+
+			case PROTO_DEVICE_BOARD_REV:
+				cout((uint8_t *)&board_info.board_rev, sizeof(board_info.board_rev));
+				break;
+
+			case PROTO_DEVICE_FW_SIZE:
+				cout((uint8_t *)&board_info.fw_size, sizeof(board_info.fw_size));
+				break;
+
+			case PROTO_DEVICE_VEC_AREA:
+				for (unsigned p = 7; p <= 10; p++) {
+					uint32_t bytes = flash_func_read_word(p * 4);
+
+					cout((uint8_t *)&bytes, sizeof(bytes));
+				}
+
+				break;
+
+#if defined(ENABLE_PROG_SEQ)
+
+			case PROTO_DEVICE_PROG_WINDOW:
+				cout_word(prog_window());
+				break;
+#endif
+
+			case PROTO_DEVICE_CAPS:
+				cout_word(session_caps());
+				break;
+
+			case PROTO_DEVICE_PROG_MAX:
+				cout_word(BOARD_FLASH_BUFFER_SIZE);
+				break;
+
+#if defined(ENABLE_RAM_LOAD)
+
+			case PROTO_DEVICE_RAM_WINDOW:
+				cout_word((uint32_t)_ram_image_start);
+				cout_word(_ram_image_end - _ram_image_start);
+				break;
+#endif
+
+			default:
+				goto cmd_bad;
+			}
+
+			break;
+
+		// erase and prepare for programming
+		//
+		// command:		ERASE/EOC
+		// success reply:	INSYNC/OK
+		// erase failure:	INSYNC/FAILURE
+		//
+		case PROTO_CHIP_ERASE:
+
+			/* expect EOC */
+			if (!wait_for_eoc(2)) {
+				goto cmd_bad;
+			}
+
+#if defined(TARGET_HW_PX4_FMU_V4)
+
+			if (check_silicon()) {
+				goto bad_silicon;
+			}
+
+#endif
+#if defined(ENABLE_JOBS)
+			// erase all sectors and verify the erase
+			job_start(PROTO_JOB_ERASE, &address);
+			job_finish(&address, &first_word, &prog_seq);
+
+			if (job.state != PROTO_JOB_DONE) {
+				goto cmd_fail;
+			}
+
+#else
+			erase_begin(&address);
+
+			// erase all sectors
+			for (int i = 0; flash_func_sector_size(i) != 0; i++) {
+				flash_func_erase_sector(i);
+			}
+
+			// enable the LED while verifying the erase
+			led_set(LED_OFF);
+
+			// verify the erase
+			for (uint32_t p = 0; p < board_info.fw_size; p += 4) {
+				if (flash_func_read_word(p) != 0xffffffff) {
+					goto cmd_fail;
+				}
+			}
+
+			erase_end(&address, &first_word, &prog_seq);
+#endif
+			break;
+
+#if defined(ENABLE_JOBS)
+
+		// start a long operation in the background
+		//
+		// command:		JOB_START/<job:1>/EOC
+		// success reply:	INSYNC/OK
+		// bad job:		INSYNC/INVALID
+		//
+		case PROTO_JOB_START:
+			arg = cin_wait(100);
+
+			if (arg < 0) {
+				goto cmd_bad;
+			}
+
+			/* expect EOC */
+			if (!wait_for_eoc(2)) {
+				goto cmd_bad;
+			}
+
+			if (arg != PROTO_JOB_ERASE && arg != PROTO_JOB_CRC) {
+				goto cmd_bad;
+			}
+
+#if defined(TARGET_HW_PX4_FMU_V4)
+
+			if (arg == PROTO_JOB_ERASE && check_silicon()) {
+				goto bad_silicon;
+			}
+
+#endif
+			if (arg == PROTO_JOB_CRC && prog_flush(&address, &first_word, &flash_buffer)) {
+				goto cmd_fail;
+			}
+
+			job_start(arg, &address);
+			break;
+
+		// report the progress of the background operation
+		//
+		// <result> is the CRC once a CRC job is done, else 0.
+		//
+		// command:		GET_STATUS/EOC
+		// reply:		<job:1>/<state:1>/<percent:1>/<sector:1>/<result:4>/INSYNC/OK
+		//
+		case PROTO_GET_STATUS: {
+				/* expect EOC */
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
+				}
+
+				uint8_t status[4] = { job.kind, job.state, job_percent(), job.sector };
+
+				cout(status, sizeof(status));
+				cout_word((job.state == PROTO_JOB_DONE) ? job.result : 0);
+			}
+			break;
+#endif
+
+#if defined(ENABLE_SECTOR_UPDATE)
+
+		// fetch CRC of one app sector
+		//
+		// The CRC is computed as for GET_CRC, over just the sector.
+		//
+		// command:			GET_SECTOR_CRC/<sector:1>/EOC
+		// reply:			<size:4>/<crc:4>/INSYNC/OK
+		// past the last sector:	<0:4>/<0:4>/INSYNC/OK
+		//
+		case PROTO_GET_SECTOR_CRC: {
+				uint32_t offset;
+
+				arg = cin_wait(100);
+
+				if (arg < 0) {
+					goto cmd_bad;
+				}
+
+				// expect EOC
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
+				}
+
+				uint32_t size = sector_extent(arg, &offset);
+
+				cout_word(size);
+				cout_word(crc_range(offset, offset + size, first_word, 0));
+			}
+			break;
+
+#if defined(ENABLE_PARTITIONS)
+
+		// fetch the place, size and CRC of one partition
+		//
+		// The CRC is computed as for GET_SECTOR_CRC.
+		//
+		// command:			GET_PARTITION/<index:1>/EOC
+		// reply:			<offset:4>/<size:4>/<crc:4>/<name:8>/INSYNC/OK
+		// past the last partition:	<0:4>/<0:4>/<0:4>/<0:8>/INSYNC/OK
+		//
+		case PROTO_GET_PARTITION: {
+				static const char no_name[8];
+				uint32_t offset;
+				unsigned sectors;
+
+				arg = cin_wait(100);
+
+				if (arg < 0) {
+					goto cmd_bad;
+				}
+
+				// expect EOC
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
+				}
+
+				uint32_t size = partition_extent(arg, &offset, &sectors);
+
+				cout_word(offset);
+				cout_word(size);
+				cout_word(size ? crc_range(offset, offset + size, first_word, 0) : 0);
+				cout((uint8_t *)(size ? partitions[arg].name : no_name), sizeof(no_name));
+			}
+			break;
+#endif
+
+		// erase one app sector and prepare for programming it
+		//
+		// Sector 0 holds the first word of the image and must be erased
+		// before any other sector, so a partial update can never boot.
+		//
+		// command:		ERASE_SECTOR/<sector:1>/EOC
+		// success reply:	INSYNC/OK
+		// bad sector:		INSYNC/INVALID
+		// erase failure,
+		// sector 0 not erased:	INSYNC/FAILURE
+		//
+		// erase one partition and prepare for programming it
+		//
+		// command:		ERASE_PARTITION/<index:1>/EOC
+		// success reply:	INSYNC/OK
+		// bad partition:	INSYNC/INVALID
+		// erase failure:	INSYNC/FAILURE
+		//
+#if defined(ENABLE_PARTITIONS)
+
+		case PROTO_ERASE_PARTITION:
+#endif
+		case PROTO_ERASE_SECTOR: {
+				uint32_t offset;
+				unsigned sectors = 1;
+
+				arg = cin_wait(100);
+
+				if (arg < 0) {
+					goto cmd_bad;
+				}
+
+				// expect EOC
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
+				}
+
+				uint32_t size;
+				unsigned first = arg;
+
+#if defined(ENABLE_PARTITIONS)
+
+				if (c == PROTO_ERASE_PARTITION) {
+					size = partition_extent(arg, &offset, &sectors);
+					first = size ? partitions[arg].first : 0;
+
+				} else
+#endif
+				{
+					size = sector_extent(arg, &offset);
+
+					if (size != 0 && offset != 0 && flash_func_read_word(0) != 0xffffffff) {
+						goto cmd_fail;
+					}
+				}
+
+				if (size == 0) {
+					goto cmd_bad;
+				}
+
+#if defined(TARGET_HW_PX4_FMU_V4)
+
+				if (check_silicon()) {
+					goto bad_silicon;
+				}
+
+#endif
+				erase_begin(&address);
+
+				for (unsigned i = 0; i < sectors; i++) {
+					flash_func_erase_sector(first + i + BOARD_FIRST_FLASH_SECTOR_TO_ERASE);
+				}
+
+				led_set(LED_OFF);
+
+				// verify the erase
+				for (uint32_t p = offset; p < offset + size; p += 4)
+					if (flash_func_read_word(p) != 0xffffffff) {
+						goto cmd_fail;
+					}
+
+				address = offset;
+				prog_crc = crc_range(0, offset, first_word, 0);
+				prog_seq = 0;
+				prog_pending_len = 0;
+#if defined(ENABLE_LZ4)
+				lz4_reset();
+#endif
+#if defined(ENABLE_RESUME)
+				progress_save(address, first_word);
+#endif
+
+				led_set(LED_BLINK);
+			}
+			break;
+#endif
+
+#if defined(ENABLE_RESUME)
+
+		// resume an upload interrupted by a reset or a lost link
+		//
+		// command:		RESUME/EOC
+		// success reply:	<address:4>/<crc:4>/INSYNC/OK
+		// nothing to resume:	INSYNC/FAILURE
+		//
+		case PROTO_RESUME:
+
+			// expect EOC
+			if (!wait_for_eoc(2)) {
+				goto cmd_bad;
+			}
+
+			if (progress_restore(&address, &first_word)) {
+				goto cmd_fail;
+			}
+
+			prog_tail_erased = false;
+			prog_seq = 0;
+			prog_pending_len = 0;
+#if defined(ENABLE_LZ4)
+			lz4_reset();
+#endif
+			cout_word(address);
+			cout_word(prog_crc);
+			break;
+#endif
+
+		// program bytes at current address
+		//
+		// <len> need not be a multiple of 4. The bytes of a trailing
+		// partial word are held until the next packet completes it, or
+		// until GET_CRC, JOB_START CRC or BOOT pad it with 0xff and
+		// program it.
+		//
+		// command:		PROG_MULTI/<len:1>/<data:len>/EOC
+		// success reply:	INSYNC/OK
+		// invalid reply:	INSYNC/INVALID
+		// readback failure:	INSYNC/FAILURE
+		//
+		// The sequenced form may be pipelined; every reply carries the
+		// next sequence number expected and packets that are not the
+		// expected one are dropped without being programmed.
+		//
+		// command:		PROG_SEQ/<seq:2>/<len:1>/<data:len>/EOC
+		// success reply:	<next seq:2>/INSYNC/OK
+		// out of order reply:	<next seq:2>/INSYNC/INVALID
+		// readback failure:	<next seq:2>/INSYNC/FAILURE
+		//
+		// The large form takes up to GET_DEVICE/PROG_MAX bytes at once.
+		//
+		// command:		PROG_LARGE/<len:2>/<data:len>/EOC
+		// replies as for PROG_MULTI
+		//
+		// The addressed form first moves the program address forward to
+		// <addr>, leaving the flash in between erased. It may not skip
+		// over the first word of the image or a partial word, nor skip
+		// at all unless the whole flash above the program address is
+		// known to be erased, as it is after CHIP_ERASE.
+		//
+		// command:		PROG_ADDR/<addr:4>/<len:2>/<data:len>/EOC
+		// replies as for PROG_MULTI
+		//
+		// The framed form is sequenced like PROG_SEQ and protected by a
+		// CRC (as crc32() computes it, starting from 0) over <seq>, <len>
+		// and <data>. A frame that fails the check is not programmed.
+		//
+		// command:		PROG_FRAME/<seq:2>/<len:2>/<data:len>/<crc:4>/EOC
+		// corrupted reply:	<next seq:2>/INSYNC/BAD_CRC
+		// other replies as for PROG_SEQ
+		//
+#if defined(ENABLE_PROG_ADDR)
+		case PROTO_PROG_ADDR:
+#endif
+#if defined(ENABLE_PROG_FRAME)
+		case PROTO_PROG_FRAME:
+#endif
+#if defined(ENABLE_PROG_SEQ)
+		case PROTO_PROG_SEQ:
+#endif
+#if defined(ENABLE_PROG_LARGE)
+		case PROTO_PROG_LARGE:
+#endif
+		case PROTO_PROG_MULTI:		// program bytes
+			target = address;
+
+#if defined(ENABLE_PROG_ADDR)
+
+			if (c == PROTO_PROG_ADDR) {
+				// expect address
+				if (cin_word(&target, 50)) {
+					goto cmd_bad;
+				}
+			}
+
+#endif
+#if defined(ENABLE_PROG_FRAME)
+			framed = (c == PROTO_PROG_FRAME);
+#else
+			framed = false;
+#endif
+
+			if (c == PROTO_PROG_SEQ || framed) {
+				// expect sequence number
+				uint16_t s;
+
+				if (cin_half(&s, 50)) {
+					goto cmd_bad;
+				}
+
+				seq = s;
+			}
+
+			// expect count
+			if (c == PROTO_PROG_LARGE || c == PROTO_PROG_ADDR || framed) {
+				uint16_t len;
+
+				arg = cin_half(&len, 50) ? -1 : len;
+
+			} else {
+				arg = cin_wait(50);
+			}
+
+			if (arg < 0) {
+				goto cmd_bad;
+			}
+
+			// sanity-check arguments
+			if (arg > BOARD_FLASH_BUFFER_SIZE) {
+				cin_drain(arg + (framed ? 4 : 0) + 1);
+				goto cmd_bad;
+			}
+
+			if (cin_block(flash_buffer.c + prog_pending_len, arg)) {
+				goto cmd_bad;
+			}
+
+#if defined(ENABLE_PROG_FRAME)
+
+			if (framed && cin_word(&frame_crc, 50)) {
+				goto cmd_bad;
+			}
+
+#endif
+
+			if (!wait_for_eoc(200)) {
+				goto cmd_bad;
+			}
+
+#if defined(ENABLE_PROG_FRAME)
+
+			if (framed) {
+				uint8_t header[4] = { seq, seq >> 8, arg, arg >> 8 };
+
+				if (crc32(flash_buffer.c + prog_pending_len, arg, crc32(header, sizeof(header), 0)) != frame_crc) {
+					goto bad_crc;
+				}
+			}
+
+#endif
+#if defined(ENABLE_MULTIDROP)
+
+			// in broadcast only CRC checked frames are programmed
+			if (bus_state == BUS_ALL && !framed) {
+				goto cmd_bad;
+			}
+
+#endif
+
+			// drop anything but the packet we expect next, the
+			// host will resend from the sequence number we ack
+			if (seq >= 0 && seq != prog_seq) {
+				goto cmd_bad;
+			}
+
+			// checked only once the packet has been consumed so that a
+			// stale pipelined packet cannot desync the command stream
+			if ((target & 3) || target < address || (address == 0 && target != 0) ||
+			    (target != address && (prog_pending_len != 0 || !prog_tail_erased))) {
+				goto cmd_bad;
+			}
+
+			if (target > board_info.fw_size || (prog_pending_len + arg) > (board_info.fw_size - target)) {
+				goto cmd_bad;
+			}
+
+#if defined(ENABLE_PROG_ADDR)
+			// the skipped flash stays erased
+			prog_crc = crc32_erased(target - address, prog_crc);
+			address = target;
+#endif
+
+#if defined(TARGET_HW_PX4_FMU_V4)
+
+			if (address == 0 && check_silicon()) {
+				goto bad_silicon;
+			}
+
+#endif
+
+			// program the whole words and hold back the rest
+			for (unsigned i = 0; i < prog_pending_len; i++) {
+				flash_buffer.c[i] = prog_pending[i];
+			}
+
+			arg += prog_pending_len;
+			prog_pending_len = arg & 3;
+			arg -= prog_pending_len;
+
+			for (unsigned i = 0; i < prog_pending_len; i++) {
+				prog_pending[i] = flash_buffer.c[arg + i];
+			}
+
+			if (arg > 0 && prog_buffer(&address, &first_word, &flash_buffer, arg)) {
+				goto cmd_fail;
+			}
+
+			if (seq >= 0) {
+				prog_seq++;
+				cout((uint8_t *)&prog_seq, sizeof(prog_seq));
+			}
+
+			break;
+
+#if defined(ENABLE_LZ4)
+
+		// decompress and program bytes at current address
+		//
+		// The chunks form one LZ4 block, so sequences may span commands.
+		// Do not mix with the other program commands between erases. The
+		// block must decode to whole words, or GET_CRC, JOB_START CRC and
+		// BOOT fail.
+		//
+		// command:		PROG_LZ4/<len:2>/<data:len>/EOC
+		// success reply:	INSYNC/OK
+		// invalid reply:	INSYNC/INVALID
+		// corrupt stream,
+		// readback failure:	INSYNC/FAILURE
+		//
+		case PROTO_PROG_LZ4: {
+				uint16_t len;
+
+				if (cin_half(&len, 50)) {
+					goto cmd_bad;
+				}
+
+				arg = len;
+
+				if (arg > BOARD_FLASH_BUFFER_SIZE) {
+					cin_drain(arg + 1);
+					goto cmd_bad;
+				}
+
+				if (cin_block(input_buffer.c, arg)) {
+					goto cmd_bad;
+				}
+
+				if (!wait_for_eoc(200)) {
+					goto cmd_bad;
+				}
 
-	while (true) {
-		volatile int c;
-		int arg;
-		static flash_buffer_t flash_buffer;
+				// bytes held back from an unaligned PROG_* would be lost
+				if (address >= board_info.fw_size || prog_pending_len != 0) {
+					goto cmd_bad;
+				}
 
-		// Wait for a command byte
-		led_off(LED_ACTIVITY);
+#if defined(ENABLE_MULTIDROP)
 
-		do {
-			/* if we have a timeout and the timer has expired, return now */
-			if (timeout && !timer[TIMER_BL_WAIT]) {
-				return;
-			}
+				if (bus_state == BUS_ALL) {
+					goto cmd_bad;
+				}
 
-			/* try to get a byte from the host */
-			c = cin_wait(0);
+#endif
 
-		} while (c < 0);
+#if defined(TARGET_HW_PX4_FMU_V4)
 
-		led_on(LED_ACTIVITY);
+				if (address == 0 && check_silicon()) {
+					goto bad_silicon;
+				}
 
-		// handle the command byte
-		switch (c) {
+#endif
 
-		// sync
+				if (lz4_decode(input_buffer.c, arg, &address, &first_word, &flash_buffer)) {
+					goto cmd_fail;
+				}
+			}
+			break;
+#endif
+
+		// fetch CRC of the entire flash area
 		//
-		// command:		GET_SYNC/EOC
-		// reply:		INSYNC/OK
+		// command:			GET_CRC/EOC
+		// reply:			<crc:4>/INSYNC/OK
 		//
-		case PROTO_GET_SYNC:
+		case PROTO_GET_CRC:
 
-			/* expect EOC */
+			// expect EOC
 			if (!wait_for_eoc(2)) {
 				goto cmd_bad;
 			}
 
-			break;
+			// the image is complete, so program any partial word
+			if (prog_flush(&address, &first_word, &flash_buffer)) {
+				goto cmd_fail;
+			}
 
-		// get device info
-		//
-		// command:		GET_DEVICE/<arg:1>/EOC
-		// BL_REV reply:	<revision:4>/INSYNC/EOC
-		// BOARD_ID reply:	<board type:4>/INSYNC/EOC
-		// BOARD_REV reply:	<board rev:4>/INSYNC/EOC
-		// FW_SIZE reply:	<firmware size:4>/INSYNC/EOC
-		// VEC_AREA reply	<vectors 7-10:16>/INSYNC/EOC
-		// bad arg reply:	INSYNC/INVALID
-		//
-		case PROTO_GET_DEVICE:
-			/* expect arg then EOC */
-			arg = cin_wait(1000);
+			// after a plain upload only the erased tail is left to add,
+			// otherwise compute CRC of the programmed area
+#if defined(ENABLE_ERASED_CRC)
 
-			if (arg < 0) {
-				goto cmd_bad;
-			}
+			if (prog_tail_erased) {
+				cout_word(crc32_erased(board_info.fw_size - address, prog_crc));
 
-			if (!wait_for_eoc(2)) {
-				goto cmd_bad;
+			} else
+#endif
+			{
+				cout_word(crc_range(0, board_info.fw_size, first_word, 0));
 			}
 
-			switch (arg) {
-			case PROTO_DEVICE_BL_REV:
-				cout((uint8_t *)&bl_proto_rev, sizeof(bl_proto_rev));
-				break;
+			break;
 
-			case PROTO_DEVICE_BOARD_ID:
-				cout((uint8_t *)&board_info.board_type, sizeof(board_info.board_type));
-				break;
+#if defined(ENABLE_GET_DIGEST)
 
-			case PROTO_DEVICE_BOARD_REV:
-				cout((uint8_t *)&board_info.board_rev, sizeof(board_info.board_rev));
-				break;
+		// fetch a CRC or hash of part of the flash area
+		//
+		// <offset> and <len> must be multiples of 4. The CRC is computed
+		// as for GET_CRC.
+		//
+		// command:			GET_DIGEST/<alg:1>/<offset:4>/<len:4>/EOC
+		// DIGEST_CRC32 reply:		<crc:4>/INSYNC/OK
+		// DIGEST_SHA256 reply:		<sha-256:32>/INSYNC/OK
+		// bad arg reply:		INSYNC/INVALID
+		//
+		case PROTO_GET_DIGEST: {
+				uint32_t offset;
+				uint32_t len;
 
-			case PROTO_DEVICE_FW_SIZE:
-				cout((uint8_t *)&board_info.fw_size, sizeof(board_info.fw_size));
-				break;
+				arg = cin_wait(100);
 
-			case PROTO_DEVICE_VEC_AREA:
-				for (unsigned p = 7; p <= 10; p++) {
-					uint32_t bytes = flash_func_read_word(p * 4);
+				if (arg < 0 || cin_word(&offset, 100) || cin_word(&len, 100)) {
+					goto cmd_bad;
+				}
 
-					cout((uint8_t *)&bytes, sizeof(bytes));
+				// expect EOC
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
 				}
 
-				break;
+				if ((offset & 3) || (len & 3) ||
+				    offset > board_info.fw_size || len > (board_info.fw_size - offset)) {
+					goto cmd_bad;
+				}
 
-			default:
-				goto cmd_bad;
-			}
+				switch (arg) {
+				case PROTO_DIGEST_CRC32:
+					cout_word(crc_range(offset, offset + len, first_word, 0));
+					break;
+
+#if defined(ENABLE_SHA256)
+
+				case PROTO_DIGEST_SHA256: {
+						uint8_t digest[SHA256_DIGEST_SIZE];
+
+						sha256_range(offset, offset + len, first_word, digest);
+						cout(digest, sizeof(digest));
+					}
+					break;
+#endif
 
+				default:
+					goto cmd_bad;
+				}
+			}
 			break;
+#endif
 
-		// erase and prepare for programming
+#if defined(ENABLE_VERIFY_BLOCKS)
+
+		// compare consecutive blocks of flash with the CRCs the host expects
 		//
-		// command:		ERASE/EOC
-		// success reply:	INSYNC/OK
-		// erase failure:	INSYNC/FAILURE
+		// The CRCs are computed as for GET_CRC. Bit i of the reply, LSB
+		// first, is set if block i differs. <size> must be a multiple of 4
+		// and <count> at most GET_DEVICE/PROG_MAX / 4.
 		//
-		case PROTO_CHIP_ERASE:
+		// command:			VERIFY_BLOCKS/<offset:4>/<size:4>/<count:2>/<crc:4 * count>/EOC
+		// reply:			<bitmap:(count + 7) / 8>/INSYNC/OK
+		// bad arg reply:		INSYNC/INVALID
+		//
+		case PROTO_VERIFY_BLOCKS: {
+				uint32_t offset;
+				uint32_t size;
+				uint16_t count;
 
-			/* expect EOC */
-			if (!wait_for_eoc(2)) {
-				goto cmd_bad;
-			}
+				if (cin_word(&offset, 100) || cin_word(&size, 100) || cin_half(&count, 100)) {
+					goto cmd_bad;
+				}
 
-#if defined(TARGET_HW_PX4_FMU_V4)
+				if (count > BOARD_FLASH_BUFFER_SIZE / 4) {
+					goto cmd_bad;
+				}
 
-			if (check_silicon()) {
-				goto bad_silicon;
-			}
+				if (cin_block(flash_buffer.c, count * 4)) {
+					goto cmd_bad;
+				}
 
-#endif
-			// clear the bootloader LED while erasing - it stops blinking at random
-			// and that's confusing
-			led_set(LED_ON);
+				// expect EOC
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
+				}
 
-			// erase all sectors
-			flash_unlock();
+				if ((offset & 3) || (size & 3) || size == 0 || offset > board_info.fw_size ||
+				    count > (board_info.fw_size - offset) / size) {
+					goto cmd_bad;
+				}
 
-			for (int i = 0; flash_func_sector_size(i) != 0; i++) {
-				flash_func_erase_sector(i);
-			}
+				uint8_t bits = 0;
 
-			// enable the LED while verifying the erase
-			led_set(LED_OFF);
+				for (unsigned i = 0; i < count; i++) {
+					uint32_t start = offset + i * size;
 
-			// verify the erase
-			for (address = 0; address < board_info.fw_size; address += 4)
-				if (flash_func_read_word(address) != 0xffffffff) {
-					goto cmd_fail;
-				}
+					if (crc_range(start, start + size, first_word, 0) != flash_buffer.w[i]) {
+						bits |= 1 << (i % 8);
+					}
 
-			address = 0;
+					// bitmap byte i / 8 overwrites CRC word i / 32,
+					// which has been compared by now
+					if (i % 8 == 7 || i == count - 1) {
+						flash_buffer.c[i / 8] = bits;
+						bits = 0;
+					}
+				}
 
-			// resume blinking
-			led_set(LED_BLINK);
+				cout(flash_buffer.c, (count + 7) / 8);
+			}
 			break;
+#endif
 
-		// program bytes at current address
+#if defined(ENABLE_SET_VERIFY)
+
+		// choose when programmed data is read back
 		//
-		// command:		PROG_MULTI/<len:1>/<data:len>/EOC
-		// success reply:	INSYNC/OK
-		// invalid reply:	INSYNC/INVALID
-		// readback failure:	INSYNC/FAILURE
+		// Applies to the program commands other than PROG_MULTI_ENCRYPTED,
+		// until it is changed again.
 		//
-		case PROTO_PROG_MULTI:		// program bytes
-			// expect count
-			arg = cin_wait(50);
+		// command:			SET_VERIFY/<mode:1>/EOC
+		// success reply:		INSYNC/OK
+		// bad mode reply:		INSYNC/INVALID
+		//
+		case PROTO_SET_VERIFY:
+			arg = cin_wait(100);
 
 			if (arg < 0) {
 				goto cmd_bad;
 			}
 
-			// sanity-check arguments
-			if (arg % 4) {
-				goto cmd_bad;
-			}
-
-			if ((address + arg) > board_info.fw_size) {
+			// expect EOC
+			if (!wait_for_eoc(2)) {
 				goto cmd_bad;
 			}
 
-			if (arg > sizeof(flash_buffer.c)) {
+			if (arg > PROTO_VERIFY_NONE) {
 				goto cmd_bad;
 			}
 
-			for (int i = 0; i < arg; i++) {
-				c = cin_wait(1000);
-
-				if (c < 0) {
-					goto cmd_bad;
-				}
+			verify_mode = arg;
+			break;
+#endif
 
-				flash_buffer.c[i] = c;
-			}
+#if defined(ENABLE_READ_MULTI)
 
-			if (!wait_for_eoc(200)) {
-				goto cmd_bad;
-			}
+		// read bytes from one of the address spaces
+		//
+		// <offset> and <len> must be multiples of 4. OTP past the end of
+		// the chip's OTP area reads as 0.
+		//
+		// With encryption the flash cannot be read, so that the host never
+		// sees the plaintext of an encrypted upload.
+		//
+		// command:			READ_MULTI/<space:1>/<offset:4>/<len:2>/EOC
+		// reply:			<data:len>/INSYNC/OK
+		// bad arg reply:		INSYNC/INVALID
+		//
+		case PROTO_READ_MULTI: {
+				uint32_t offset;
+				uint16_t len;
+				uint32_t limit;
 
-			if (address == 0) {
+				arg = cin_wait(100);
 
-#if defined(TARGET_HW_PX4_FMU_V4)
+				if (arg < 0 || cin_word(&offset, 100) || cin_half(&len, 100)) {
+					goto cmd_bad;
+				}
 
-				if (check_silicon()) {
-					goto bad_silicon;
+				// expect EOC
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
 				}
 
-#endif
-#if defined(ENABLE_ENCRYPTION)
-				// An unencrypted Download is Ok to do
-				// But the Key will be Zeroed out.
-				// This will then void the warranty on this unit.
-				zero_key();
-#endif
-				// save the first word and don't program it until everything else is done
-				first_word = flash_buffer.w[0];
-				// replace first word with bits we can overwrite later
-				flash_buffer.w[0] = 0xffffffff;
-			}
+				switch (arg) {
+#if !defined(ENABLE_ENCRYPTION)
 
-			arg /= 4;
+				case PROTO_SPACE_FLASH:
+					limit = board_info.fw_size;
+					break;
+#endif
 
-			for (int i = 0; i < arg; i++) {
+				case PROTO_SPACE_OTP:
+					limit = 0xffffffff;
+					break;
 
-				// program the word
-				flash_func_write_word(address, flash_buffer.w[i]);
+				case PROTO_SPACE_UDID:
+					limit = 12;
+					break;
 
-				// do immediate read-back verify
-				if (flash_func_read_word(address) != flash_buffer.w[i]) {
-					goto cmd_fail;
+				default:
+					goto cmd_bad;
 				}
 
-				address += 4;
-			}
-
-			break;
+				if ((offset & 3) || (len & 3) || offset > limit || len > (limit - offset)) {
+					goto cmd_bad;
+				}
 
-		// fetch CRC of the entire flash area
-		//
-		// command:			GET_CRC/EOC
-		// reply:			<crc:4>/INSYNC/OK
-		//
-		case PROTO_GET_CRC:
+				// send a USB packet's worth at a time
+				uint32_t words[16];
+				unsigned n = 0;
 
-			// expect EOC
-			if (!wait_for_eoc(2)) {
-				goto cmd_bad;
-			}
+				for (uint32_t p = offset; p < offset + len; p += 4) {
+					if (arg == PROTO_SPACE_OTP) {
+						words[n++] = flash_func_read_otp(p);
 
-			// compute CRC of the programmed area
-			uint32_t sum = 0;
+					} else if (arg == PROTO_SPACE_UDID) {
+						words[n++] = flash_func_read_sn(p);
 
-			for (unsigned p = 0; p < board_info.fw_size; p += 4) {
-				uint32_t bytes;
+					} else if ((p == 0) && (first_word != 0xffffffff)) {
+						words[n++] = first_word;
 
-				if ((p == 0) && (first_word != 0xffffffff)) {
-					bytes = first_word;
+					} else {
+						words[n++] = flash_func_read_word(p);
+					}
 
-				} else {
-					bytes = flash_func_read_word(p);
+					if (n == 16 || p + 4 == offset + len) {
+						cout((uint8_t *)words, n * 4);
+						n = 0;
+					}
 				}
-
-				sum = crc32((uint8_t *)&bytes, sizeof(bytes), sum);
 			}
-
-			cout_word(sum);
 			break;
+#endif
 
 		// read a word from the OTP
 		//
@@ -940,22 +3141,86 @@ bootloader(unsigned timeout)
 
 		// read the chip  description
 		//
-		// command:			GET_CHIP_DES/EOC
-		// reply:			<value:4>/INSYNC/OK
-		case PROTO_GET_CHIP_DES: {
+		// command:			GET_CHIP_DES/EOC
+		// reply:			<value:4>/INSYNC/OK
+		case PROTO_GET_CHIP_DES: {
+				uint8_t buffer[MAX_DES_LENGTH];
+				unsigned len = MAX_DES_LENGTH;
+
+				// expect EOC
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
+				}
+
+				len = get_mcu_desc(len, buffer);
+				cout_word(len);
+				cout(buffer, len);
+			}
+			break;
+
+#if defined(ENABLE_GET_INFO)
+
+		// read all the identification data in one go
+		//
+		// All fields are as for the individual commands. Later versions
+		// only append fields. <len> is the number of bytes that follow
+		// it, up to INSYNC. <prog window> is 0 without CAP_PROG_SEQ.
+		//
+		// command:			GET_INFO/EOC
+		// reply:			<version:4>/<len:4>
+		//				<bl rev:4>/<board type:4>/<board rev:4>/<fw size:4>
+		//				<vectors 7-10:16>
+		//				<caps:4>/<prog max:4>/<prog window:4>
+		//				<chip id:4>/<des len:4>/<des:des len>
+		//				<sn:12>
+		//				<runs:4>/runs * (<sectors:4>/<size:4>)
+		//				/INSYNC/OK
+		//
+		case PROTO_GET_INFO: {
 				uint8_t buffer[MAX_DES_LENGTH];
-				unsigned len = MAX_DES_LENGTH;
+				unsigned len;
+				uint32_t runs;
 
 				// expect EOC
 				if (!wait_for_eoc(2)) {
 					goto cmd_bad;
 				}
 
-				len = get_mcu_desc(len, buffer);
+				len = get_mcu_desc(sizeof(buffer), buffer);
+				runs = cout_geometry(false);
+
+				cout_word(PROTO_INFO_VERSION);
+				cout_word(4 * 4 + 16 + 3 * 4 + 2 * 4 + len + 12 + 4 + runs * 8);
+				cout_word(bl_proto_rev);
+				cout_word(board_info.board_type);
+				cout_word(board_info.board_rev);
+				cout_word(board_info.fw_size);
+
+				for (unsigned p = 7; p <= 10; p++) {
+					cout_word(flash_func_read_word(p * 4));
+				}
+
+				cout_word(session_caps());
+				cout_word(BOARD_FLASH_BUFFER_SIZE);
+#if defined(ENABLE_PROG_SEQ)
+				cout_word(prog_window());
+#else
+				cout_word(0);
+#endif
+
+				cout_word(get_mcu_id());
 				cout_word(len);
 				cout(buffer, len);
+
+				for (unsigned p = 0; p < 12; p += 4) {
+					cout_word(flash_func_read_sn(p));
+				}
+
+				cout_word(runs);
+				cout_geometry(true);
 			}
 			break;
+#endif
 
 #ifdef BOOT_DELAY_ADDRESS
 
@@ -993,6 +3258,7 @@ bootloader(unsigned timeout)
 
 				uint32_t value = (BOOT_DELAY_SIGNATURE1 & 0xFFFFFF00) | boot_delay;
 				flash_func_write_word(BOOT_DELAY_ADDRESS, value);
+				prog_tail_erased = false;
 
 				if (flash_func_read_word(BOOT_DELAY_ADDRESS) != value) {
 					goto cmd_fail;
@@ -1013,6 +3279,10 @@ bootloader(unsigned timeout)
 				goto cmd_bad;
 			}
 
+			if (prog_flush(&address, &first_word, &flash_buffer)) {
+				goto cmd_fail;
+			}
+
 			// program the deferred first word
 			if (first_word != 0xffffffff) {
 				flash_func_write_word(0, first_word);
@@ -1025,9 +3295,13 @@ bootloader(unsigned timeout)
 				first_word = 0xffffffff;
 			}
 
+#if defined(ENABLE_RESUME)
+			progress_clear();
+#endif
+
 			// send a sync and wait for it to be collected
 			sync_response();
-			delay(100);
+			cflush(100);
 
 			// quiesce and jump to the app
 			return;
@@ -1036,6 +3310,368 @@ bootloader(unsigned timeout)
 			// XXX reserved for ad-hoc debugging as required
 			break;
 
+#if defined(ENABLE_RAM_LOAD)
+
+		// copy bytes into the RAM window
+		//
+		// command:			LOAD_RAM/<offset:4>/<len:2>/<data:len>/EOC
+		// success reply:		INSYNC/OK
+		// invalid reply:		INSYNC/INVALID
+		//
+		case PROTO_LOAD_RAM: {
+				uint32_t offset;
+				uint16_t len;
+
+				if (cin_word(&offset, 50) || cin_half(&len, 50)) {
+					goto cmd_bad;
+				}
+
+				if (offset > (uint32_t)(_ram_image_end - _ram_image_start) ||
+				    len > (uint32_t)(_ram_image_end - _ram_image_start) - offset) {
+					goto cmd_bad;
+				}
+
+				if (cin_block(_ram_image_start + offset, len)) {
+					goto cmd_bad;
+				}
+
+				if (!wait_for_eoc(200)) {
+					goto cmd_bad;
+				}
+			}
+			break;
+
+		// check the image in the RAM window and start it
+		//
+		// <crc> is computed as crc32() does, starting from 0, over the
+		// first <len> bytes of the window. The entry point in the vector
+		// table must lie within them.
+		//
+		// command:			RUN_RAM/<len:4>/<crc:4>/EOC
+		// success reply:		INSYNC/OK, then the image starts
+		// bad image reply:		INSYNC/FAILURE
+		//
+		case PROTO_RUN_RAM: {
+				const uint32_t *base = (const uint32_t *)_ram_image_start;
+				uint32_t len;
+				uint32_t crc;
+
+				if (cin_word(&len, 50) || cin_word(&crc, 50)) {
+					goto cmd_bad;
+				}
+
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
+				}
+
+				if (len < 8 || len > (uint32_t)(_ram_image_end - _ram_image_start)) {
+					goto cmd_fail;
+				}
+
+				if (crc32(_ram_image_start, len, 0) != crc) {
+					goto cmd_fail;
+				}
+
+				if (base[1] < (uint32_t)base || base[1] >= (uint32_t)base + len) {
+					goto cmd_fail;
+				}
+
+				// send a sync and wait for it to be collected
+				sync_response();
+				cflush(100);
+
+				boot_image(base);
+			}
+			break;
+#endif
+#if defined(ENABLE_SET_BAUD)
+
+		// change the baud rate of the USART
+		//
+		// Only over the USART. The reply is sent at the current rate,
+		// then the host must send GET_SYNC at the new one within
+		// PROTO_SET_BAUD_CONFIRM_MS, which is answered as usual. Without
+		// it the board goes back to the current rate and says nothing.
+		//
+		// command:			SET_BAUD/<baud:4>/<flags:1>/EOC
+		// success reply:		INSYNC/OK, then INSYNC/OK to GET_SYNC
+		// unsupported rate or flags:	INSYNC/INVALID
+		//
+		case PROTO_SET_BAUD: {
+				uint32_t baud;
+				uint32_t old_baud = uart_get_baudrate();
+				bool old_flow = uart_get_flow_control();
+				bool confirmed = false;
+				int last = -1;
+
+				if (cin_word(&baud, 100)) {
+					goto cmd_bad;
+				}
+
+				arg = cin_wait(100);
+
+				if (arg < 0) {
+					goto cmd_bad;
+				}
+
+				// expect EOC
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
+				}
+
+				if (bl_type != USART || (arg & ~PROTO_BAUD_FLOW) || !uart_check_baudrate(baud)) {
+					goto cmd_bad;
+				}
+
+#if !defined(BOARD_PIN_RTS) || !defined(BOARD_PIN_CTS)
+
+				if (arg & PROTO_BAUD_FLOW) {
+					goto cmd_bad;
+				}
+
+#endif
+				sync_response();
+				uart_set_baudrate(baud, arg & PROTO_BAUD_FLOW);
+
+				uint32_t start = time_us();
+
+				while (!confirmed && (time_us() - start) < PROTO_SET_BAUD_CONFIRM_MS * 1000) {
+					int b = cin();
+
+					if (b >= 0) {
+						confirmed = (last == PROTO_GET_SYNC && b == PROTO_EOC);
+						last = b;
+					}
+				}
+
+				if (!confirmed) {
+					uart_set_baudrate(old_baud, old_flow);
+					continue;
+				}
+			}
+			break;
+#endif
+#if defined(ENABLE_BRIDGE)
+
+		// sync with the bootloader of the second MCU and erase it
+		//
+		// command:			BRIDGE_START/EOC
+		// success reply:		<fw_size:4>/INSYNC/OK, fw_size of the second MCU
+		// no reply or erase failure:	INSYNC/FAILURE
+		//
+		case PROTO_BRIDGE_START: {
+				static const uint8_t sync[] = { PROTO_GET_SYNC, PROTO_EOC };
+				static const uint8_t get_size[] = { PROTO_GET_DEVICE, PROTO_DEVICE_FW_SIZE, PROTO_EOC };
+				static const uint8_t erase[] = { PROTO_CHIP_ERASE, PROTO_EOC };
+				unsigned tries;
+
+				// expect EOC
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
+				}
+
+				bridge_cinit();
+				bridge_fw_size = 0;
+
+				for (tries = 0; tries < BRIDGE_SYNC_TRIES; tries++) {
+					if (bridge_command(sync, sizeof(sync), NULL, 0, 50)) {
+						break;
+					}
+				}
+
+				if (tries == BRIDGE_SYNC_TRIES ||
+				    !bridge_command(get_size, sizeof(get_size), (uint8_t *)&bridge_fw_size, 4, 100)) {
+					goto cmd_fail;
+				}
+
+				led_set(LED_ON);
+
+				if (!bridge_command(erase, sizeof(erase), NULL, 0, BRIDGE_ERASE_MS)) {
+					bridge_fw_size = 0;
+					goto cmd_fail;
+				}
+
+				led_set(LED_BLINK);
+
+				bridge_address = 0;
+				bridge_crc = 0;
+				cout_word(bridge_fw_size);
+			}
+			break;
+
+		// program bytes of the second MCU at its program address
+		//
+		// <len> must be a multiple of 4 and at most GET_DEVICE/PROG_MAX.
+		//
+		// command:			BRIDGE_PROG/<len:2>/<data:len>/EOC
+		// success reply:		INSYNC/OK
+		// invalid reply:		INSYNC/INVALID
+		// not started or failed:	INSYNC/FAILURE
+		//
+		case PROTO_BRIDGE_PROG: {
+				uint16_t len;
+
+				if (cin_half(&len, 50)) {
+					goto cmd_bad;
+				}
+
+				if (len == 0 || (len & 3) || len > BOARD_FLASH_BUFFER_SIZE) {
+					goto cmd_bad;
+				}
+
+				if (cin_block(flash_buffer.c, len)) {
+					goto cmd_bad;
+				}
+
+				// expect EOC
+				if (!wait_for_eoc(200)) {
+					goto cmd_bad;
+				}
+
+				if (len > bridge_fw_size - bridge_address) {
+					goto cmd_fail;
+				}
+
+				for (unsigned p = 0; p < len; p += BRIDGE_PROG_CHUNK) {
+					uint8_t cmd[BRIDGE_PROG_CHUNK + 3];
+					unsigned n = len - p;
+
+					if (n > BRIDGE_PROG_CHUNK) {
+						n = BRIDGE_PROG_CHUNK;
+					}
+
+					cmd[0] = PROTO_PROG_MULTI;
+					cmd[1] = n;
+
+					for (unsigned i = 0; i < n; i++) {
+						cmd[2 + i] = flash_buffer.c[p + i];
+					}
+
+					cmd[2 + n] = PROTO_EOC;
+
+					if (!bridge_command(cmd, n + 3, NULL, 0, 500)) {
+						goto cmd_fail;
+					}
+
+					bridge_crc = crc32(cmd + 2, n, bridge_crc);
+					bridge_address += n;
+				}
+			}
+			break;
+
+		// check the CRC of the second MCU and boot it
+		//
+		// The CRC is compared with the one of the data sent, padded with
+		// 0xff to the fw_size of the second MCU.
+		//
+		// command:			BRIDGE_END/EOC
+		// success reply:		<crc:4>/INSYNC/OK
+		// CRC mismatch:		<crc:4>/INSYNC/FAILURE
+		// no reply:			INSYNC/FAILURE
+		//
+		case PROTO_BRIDGE_END: {
+				static const uint8_t get_crc[] = { PROTO_GET_CRC, PROTO_EOC };
+				static const uint8_t boot[] = { PROTO_BOOT, PROTO_EOC };
+				uint32_t crc;
+
+				// expect EOC
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
+				}
+
+				if (bridge_fw_size == 0 ||
+				    !bridge_command(get_crc, sizeof(get_crc), (uint8_t *)&crc, 4, BRIDGE_CRC_MS)) {
+					goto cmd_fail;
+				}
+
+				cout_word(crc);
+
+				if (crc != crc32_erased(bridge_fw_size - bridge_address, bridge_crc) ||
+				    !bridge_command(boot, sizeof(boot), NULL, 0, 500)) {
+					goto cmd_fail;
+				}
+
+				bridge_fw_size = 0;
+			}
+			break;
+#endif
+#if defined(ENABLE_MULTIDROP)
+
+		// choose which node on a shared bus takes the following commands
+		//
+		// <udid> is the 12 byte UDID of the node, as read with GET_SN, or
+		// PROTO_BUS_ALL in all three words for every node. <crc> is crc32()
+		// of <udid> starting from 0, so that a node cannot take another
+		// node's reply data for a BUS_SELECT.
+		//
+		// The selected node reports its state and then replies as usual.
+		// The others stay silent. After BUS_SELECT ALL no node replies.
+		//
+		// command:			BUS_SELECT/<udid:12>/<crc:4>/EOC
+		// selected node reply:		<errors:4>/<address:4>/<crc:4>/INSYNC/OK
+		//
+		case PROTO_BUS_SELECT: {
+				union {
+					uint8_t		c[12];
+					uint32_t	w[3];
+				} udid;
+				uint32_t crc;
+				bool all = true;
+				bool mine = true;
+
+				if (bus_state == BUS_OTHER) {
+					// already read and checked by bus_watch()
+					for (unsigned i = 0; i < sizeof(udid.c); i++) {
+						udid.c[i] = bus_window[1 + i];
+					}
+
+				} else {
+					if (cin_block(udid.c, sizeof(udid.c)) || cin_word(&crc, 100)) {
+						goto cmd_bad;
+					}
+
+					// expect EOC
+					if (!wait_for_eoc(2)) {
+						goto cmd_bad;
+					}
+
+					if (crc32(udid.c, sizeof(udid.c), 0) != crc) {
+						goto cmd_bad;
+					}
+				}
+
+				for (unsigned i = 0; i < 3; i++) {
+					all = all && (udid.w[i] == PROTO_BUS_ALL);
+					mine = mine && (udid.w[i] == flash_func_read_sn(i * 4));
+				}
+
+				if (all) {
+					bus_state = BUS_ALL;
+
+				} else if (mine) {
+					bus_state = BUS_DIRECT;
+
+					// the host may not have spoken to this node before
+					if (bl_type == NONE) {
+						bl_type = last_input;
+					}
+
+					cout_word(bus_errors);
+					cout_word(address);
+					cout_word(prog_crc);
+					bus_errors = 0;
+
+				} else {
+					bus_state = BUS_OTHER;
+
+					for (unsigned i = 0; i < sizeof(bus_window); i++) {
+						bus_window[i] = 0;
+					}
+				}
+			}
+			break;
+#endif
+
 #ifdef ENABLE_ENCRYPTION
 
 		// For encrypted programming, we need the initialization vector
@@ -1048,14 +3684,8 @@ bootloader(unsigned timeout)
 		case PROTO_SET_IV:
 
 			// expect 16 bytes
-			for (int i = 0; i < 16; i++) {
-				c = cin_wait(1000);
-
-				if (c < 0) {
-					goto cmd_bad;
-				}
-
-				iv[i] = c;
+			if (cin_block(iv, sizeof(iv))) {
+				goto cmd_bad;
 			}
 
 			if (!wait_for_eoc(200)) {
@@ -1094,20 +3724,27 @@ bootloader(unsigned timeout)
 				goto cmd_bad;
 			}
 
-			for (int i = 0; i < arg; i++) {
-				c = cin_wait(1000);
+			if (cin_block(input_buffer.c, arg)) {
+				goto cmd_bad;
+			}
 
-				if (c < 0) {
-					goto cmd_bad;
-				}
+			if (!wait_for_eoc(200)) {
+				goto cmd_bad;
+			}
 
-				encrypted_buffer.c[i] = c;
+			// an unaligned PROG_* left a partial word this would skip
+			if (prog_pending_len != 0) {
+				goto cmd_bad;
 			}
 
-			if (!wait_for_eoc(200)) {
+#if defined(ENABLE_MULTIDROP)
+
+			if (bus_state == BUS_ALL) {
 				goto cmd_bad;
 			}
 
+#endif
+
 			/* Did this unit have unencrypted firmware programmed to it?
 			 * If So, then indicate so as the the warranty on this unit is voided.
 			 */
@@ -1122,11 +3759,11 @@ bootloader(unsigned timeout)
 				// We loop in chunks of 16 even though the AES function provides a
 				// length argument, however, we didn't have success using it.
 				for (int i = 0; i < arg; i += 16) {
-					AES128_CBC_decrypt_buffer(&flash_buffer.c[i], &encrypted_buffer.c[i], 16, key.b, iv);
+					AES128_CBC_decrypt_buffer(&flash_buffer.c[i], &input_buffer.c[i], 16, key.b, iv);
 
 					for (int j = 0; j < 16; ++j) {
 						// Also, it seems like we need to take care of iv on every iteration.
-						iv[j] = encrypted_buffer.c[i + j];
+						iv[j] = input_buffer.c[i + j];
 					}
 				}
 
@@ -1154,6 +3791,12 @@ bootloader(unsigned timeout)
 				// Therefore, we jump 4 bytes and start flashing from there.
 				start = 4;
 
+#if defined(ENABLE_RESUME)
+				// encrypted uploads cannot be resumed
+				progress_clear();
+#endif
+				prog_tail_erased = false;
+
 				// save the first word and don't program it until everything else is done
 				first_word = flash_buffer.w[start];
 				// replace first word with bits we can overwrite later
@@ -1174,13 +3817,22 @@ bootloader(unsigned timeout)
 				flash_func_write_word(address, flash_buffer.w[i]);
 
 				// do immediate read-back verify
-				if (flash_func_read_word(address) != flash_buffer.w[i]) {
+				if (verify_mode == PROTO_VERIFY_WORD && flash_func_read_word(address) != flash_buffer.w[i]) {
 					goto cmd_fail;
 				}
 
 				address += 4;
 			}
 
+			// or read back the whole packet, as prog_buffer() does
+			if (verify_mode == PROTO_VERIFY_PACKET) {
+				for (int i = start; i < arg; i++) {
+					if (flash_func_read_word(address - (arg - i) * 4) != flash_buffer.w[i]) {
+						goto cmd_fail;
+					}
+				}
+			}
+
 			break;
 
 		// Read the flash and compute the CRC sum over the number of bytes
@@ -1276,19 +3928,68 @@ bootloader(unsigned timeout)
 			bl_type = last_input;
 		}
 
+#if defined(BOARD_USART_DMA)
+
+		// bytes dropped from the receive ring may have belonged to it
+		if (last_input == USART && uart_rx_overrun()) {
+			goto cmd_bad;
+		}
+
+#endif
+
 		// send the sync response for this command
 		sync_response();
 		continue;
 cmd_bad:
+#if defined(ENABLE_MULTIDROP)
+
+		// nobody hears about it until this node is selected
+		if (bus_state == BUS_ALL) {
+			bus_errors++;
+		}
+
+#endif
+
+		// a sequenced command always acks the packet we expect next
+		if (seq >= 0) {
+			cout((uint8_t *)&prog_seq, sizeof(prog_seq));
+		}
+
 		// send an 'invalid' response but don't kill the timeout - could be garbage
 		invalid_response();
 		continue;
 
 cmd_fail:
+#if defined(ENABLE_MULTIDROP)
+
+		if (bus_state == BUS_ALL) {
+			bus_errors++;
+		}
+
+#endif
+
+		if (seq >= 0) {
+			cout((uint8_t *)&prog_seq, sizeof(prog_seq));
+		}
+
 		// send a 'command failed' response but don't kill the timeout - could be garbage
 		failure_response();
 		continue;
 
+#if defined(ENABLE_PROG_FRAME)
+bad_crc:
+#if defined(ENABLE_MULTIDROP)
+
+		if (bus_state == BUS_ALL) {
+			bus_errors++;
+		}
+
+#endif
+		cout((uint8_t *)&prog_seq, sizeof(prog_seq));
+		bad_crc_response();
+		continue;
+#endif
+
 #if defined(TARGET_HW_PX4_FMU_V4)
 bad_silicon:
 		// send the bad silicon response but don't kill the timeout - could be garbage
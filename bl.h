@@ -68,17 +68,12 @@ extern void delay(unsigned msec);
 #define BL_WAIT_MAGIC	0x19710317		/* magic number in PWR regs to wait in bootloader */
 
 /* generic timers */
-#define NTIMERS		4
+#define NTIMERS		3
 #define TIMER_BL_WAIT	0
-#define TIMER_CIN	1
-#define TIMER_LED	2
-#define TIMER_DELAY	3
+#define TIMER_LED	1
+#define TIMER_DELAY	2
 extern volatile unsigned timer[NTIMERS];	/* each timer decrements every millisecond if > 0 */
 
-/* generic receive buffer for async reads */
-extern void buf_put(uint8_t b);
-extern int buf_get(void);
-
 /*****************************************************************************
  * Chip/board functions.
  */
@@ -111,6 +106,14 @@ extern uint32_t flash_func_read_word(uint32_t address);
 extern uint32_t flash_func_read_otp(uint32_t address);
 extern uint32_t flash_func_read_sn(uint32_t address);
 
+/*
+ * backup registers that survive a reset, from main_*.c (ENABLE_RESUME),
+ * numbered from 0. Others read as 0 and ignore writes.
+ */
+#define BOARD_BACKUP_REGS	4
+extern uint32_t board_get_backup_reg(unsigned reg);
+extern void board_set_backup_reg(unsigned reg, uint32_t value);
+
 extern uint32_t get_mcu_id(void);
 int get_mcu_desc(int max, uint8_t *revstr);
 extern int check_silicon(void);
@@ -123,6 +126,7 @@ extern void cinit(void *config, uint8_t interface);
 extern void cfini(void);
 extern int cin(void);
 extern void cout(uint8_t *buf, unsigned len);
+extern bool cdone(void);
 
 #ifdef ENABLE_ENCRYPTION
 /*****************************************************************************
@@ -32,6 +32,7 @@
 #include "hw_config.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
@@ -73,6 +74,42 @@ static usbd_device *usbd_dev;
 /* Buffer to be used for control requests. */
 static uint8_t usbd_control_buffer[128];
 
+/*
+ * Receive ring of whole packets, read straight from the OUT endpoint. The
+ * OTG interrupt (usbd_poll() on F1) is the only producer and the main loop
+ * the only consumer. Each side writes only its own index, and moves it
+ * after the data behind a barrier. The endpoint is NAKed while the ring is
+ * full, so the host is held off rather than any bytes being lost.
+ */
+#define USB_RX_PACKET_SIZE	64
+#define USB_RX_PACKETS		(BOARD_RX_BUF_SIZE / USB_RX_PACKET_SIZE)
+
+static struct {
+	uint8_t		len;
+	uint8_t		data[USB_RX_PACKET_SIZE];
+} usb_rx_ring[USB_RX_PACKETS];
+static volatile unsigned usb_rx_head, usb_rx_tail;
+static unsigned usb_rx_pos;		/* bytes already taken from the tail packet */
+static volatile bool usb_rx_nak;
+
+#define usb_rx_barrier()	asm volatile("dmb" : : : "memory")
+
+/*
+ * Transmit ring. usb_cout() only queues and starts a packet when none is
+ * in flight; the IN-complete callback then sends the next one, so a reply
+ * goes out while the next command is coming in.
+ *
+ * Packets are kept short of the 64 byte endpoint size. A reply that ended
+ * on a full packet would leave the host waiting for the rest of the
+ * transfer. Ending it needs a zero length packet, and the write call
+ * cannot report whether that was taken.
+ */
+#define USB_TX_PACKET_SIZE	63
+
+static uint8_t usb_tx_ring[BOARD_TX_BUF_SIZE];
+static volatile unsigned usb_tx_head, usb_tx_tail;
+static volatile bool usb_tx_busy;
+
 static const struct usb_device_descriptor dev = {
 	.bLength = USB_DT_DEVICE_SIZE,
 	.bDescriptorType = USB_DT_DEVICE,	/**< Specifies he descriptor type */
@@ -255,13 +292,52 @@ static void cdcacm_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 {
 	(void)ep;
 
-	char buf[64];
-	unsigned i;
-	unsigned len = usbd_ep_read_packet(usbd_dev, 0x01, buf, sizeof(buf));
+	unsigned h = usb_rx_head;
+	unsigned next = (h + 1) % USB_RX_PACKETS;
+
+	/*
+	 * The endpoint is only armed while a slot is free, so the packet fits.
+	 * If it fills the ring, NAK before reading it so that reading does not
+	 * arm the endpoint again.
+	 */
+	if ((next + 1) % USB_RX_PACKETS == usb_rx_tail) {
+		usb_rx_nak = true;
+		usbd_ep_nak_set(usbd_dev, 0x01, 1);
+	}
+
+	usb_rx_ring[h].len = usbd_ep_read_packet(usbd_dev, 0x01, usb_rx_ring[h].data, USB_RX_PACKET_SIZE);
+
+	usb_rx_barrier();
+	usb_rx_head = next;
+}
+
+/* send the next packet from the ring, with the OTG interrupt masked or from it */
+static void usb_tx_next(usbd_device *usbd_dev)
+{
+	uint8_t buf[USB_TX_PACKET_SIZE];
+	unsigned len = 0;
+	unsigned t = usb_tx_tail;
 
-	for (i = 0; i < len; i++) {
-		buf_put(buf[i]);
+	while (len < sizeof(buf) && t != usb_tx_head) {
+		buf[len++] = usb_tx_ring[t];
+		t = (t + 1) % sizeof(usb_tx_ring);
 	}
+
+	// a packet the endpoint refuses stays queued for the next try
+	if (len == 0 || usbd_ep_write_packet(usbd_dev, 0x82, buf, len) == 0) {
+		usb_tx_busy = false;
+		return;
+	}
+
+	usb_tx_tail = t;
+	usb_tx_busy = true;
+}
+
+static void cdcacm_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	(void)ep;
+
+	usb_tx_next(usbd_dev);
 }
 
 static void cdcacm_set_config(usbd_device *usbd_dev, uint16_t wValue)
@@ -269,7 +345,7 @@ static void cdcacm_set_config(usbd_device *usbd_dev, uint16_t wValue)
 	(void)wValue;
 
 	usbd_ep_setup(usbd_dev, 0x01, USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_rx_cb);
-	usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, 64, NULL);
+	usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_tx_cb);
 	usbd_ep_setup(usbd_dev, 0x83, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
 
 	usbd_register_control_callback(
@@ -291,6 +367,12 @@ otg_fs_isr(void)
 void
 usb_cinit(void)
 {
+	usb_rx_head = usb_rx_tail = 0;
+	usb_rx_pos = 0;
+	usb_rx_nak = false;
+	usb_tx_head = usb_tx_tail = 0;
+	usb_tx_busy = false;
+
 #if defined(STM32F4)
 
 	rcc_peripheral_enable_clock(&RCC_AHB1ENR, RCC_AHB1ENR_IOPAEN);
@@ -373,6 +455,43 @@ usb_cfini(void)
 #endif
 }
 
+/* free the tail packet, and let the host send again if it was held off */
+static void
+usb_rx_release(void)
+{
+	usb_rx_pos = 0;
+	usb_rx_barrier();
+	usb_rx_tail = (usb_rx_tail + 1) % USB_RX_PACKETS;
+
+	if (usb_rx_nak) {
+#if defined(STM32F4)
+		nvic_disable_irq(NVIC_OTG_FS_IRQ);
+#endif
+		usb_rx_nak = false;
+		usbd_ep_nak_set(usbd_dev, 0x01, 0);
+#if defined(STM32F4)
+		nvic_enable_irq(NVIC_OTG_FS_IRQ);
+#endif
+	}
+}
+
+/* number of unread bytes in the tail packet, freeing any that are used up */
+static unsigned
+usb_rx_avail(void)
+{
+	while (usb_rx_tail != usb_rx_head) {
+		usb_rx_barrier();
+
+		if (usb_rx_pos < usb_rx_ring[usb_rx_tail].len) {
+			return usb_rx_ring[usb_rx_tail].len - usb_rx_pos;
+		}
+
+		usb_rx_release();
+	}
+
+	return 0;
+}
+
 int
 usb_cin(void)
 {
@@ -381,7 +500,71 @@ usb_cin(void)
 #if defined(STM32F1)
 	usbd_poll(usbd_dev);
 #endif
-	return buf_get();
+
+	if (usb_rx_avail() == 0) {
+		return -1;
+	}
+
+	return usb_rx_ring[usb_rx_tail].data[usb_rx_pos++];
+}
+
+/**
+ * Copy out as much of a payload as has already been received.
+ *
+ * @return the number of bytes copied, up to len
+ */
+unsigned
+usb_cin_block(uint8_t *buf, unsigned len)
+{
+	unsigned count = 0;
+
+	if (usbd_dev == NULL) {
+		return 0;
+	}
+
+	while (count < len) {
+		unsigned n = usb_rx_avail();
+
+		if (n == 0) {
+			break;
+		}
+
+		if (n > len - count) {
+			n = len - count;
+		}
+
+		memcpy(buf + count, &usb_rx_ring[usb_rx_tail].data[usb_rx_pos], n);
+		usb_rx_pos += n;
+		count += n;
+	}
+
+	return count;
+}
+
+/* bytes the receive ring can hold before the host is held off */
+unsigned
+usb_rx_size(void)
+{
+	return (USB_RX_PACKETS - 1) * USB_RX_PACKET_SIZE;
+}
+
+/* start a packet if none is in flight */
+static void
+usb_tx_pump(void)
+{
+#if defined(STM32F1)
+	usbd_poll(usbd_dev);
+#elif defined(STM32F4)
+	nvic_disable_irq(NVIC_OTG_FS_IRQ);
+#endif
+
+	if (!usb_tx_busy) {
+		usb_tx_next(usbd_dev);
+	}
+
+#if defined(STM32F4)
+	nvic_enable_irq(NVIC_OTG_FS_IRQ);
+#endif
 }
 
 void
@@ -389,14 +572,37 @@ usb_cout(uint8_t *buf, unsigned count)
 {
 	if (usbd_dev) {
 		while (count) {
-			unsigned len = (count > 64) ? 64 : count;
-			unsigned sent;
+			unsigned next = (usb_tx_head + 1) % sizeof(usb_tx_ring);
 
-			sent = usbd_ep_write_packet(usbd_dev, 0x82, buf, len);
+			// only wait when the ring is full
+			if (next == usb_tx_tail) {
+				usb_tx_pump();
+				continue;
+			}
 
-			count -= sent;
-			buf += sent;
+			usb_tx_ring[usb_tx_head] = *buf++;
+			usb_tx_head = next;
+			count--;
 		}
+
+		usb_tx_pump();
 	}
 }
+
+/**
+ * Check whether everything queued by usb_cout() has been taken by the host.
+ *
+ * @return true once the IN transfer of the last packet has completed
+ */
+bool
+usb_tx_done(void)
+{
+	if (usbd_dev == NULL) {
+		return true;
+	}
+
+	usb_tx_pump();
+
+	return !usb_tx_busy && usb_tx_tail == usb_tx_head;
+}
 #endif
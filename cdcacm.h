@@ -43,4 +43,7 @@
 extern void usb_cinit(void);
 extern void usb_cfini(void);
 extern int usb_cin(void);
+extern unsigned usb_cin_block(uint8_t *buf, unsigned len);
+extern unsigned usb_rx_size(void);
 extern void usb_cout(uint8_t *buf, unsigned len);
+extern bool usb_tx_done(void);
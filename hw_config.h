@@ -52,6 +52,81 @@
  *                                                                        and hence the address space of FLASH to erase and program.
  * USBMFGSTRING            "PX4 AP"            - Optional USB MFG string (default is '3D Robotics' if not defined.)
  * SERIAL_BREAK_DETECT_DISABLED                -  Optional prevent break selection on Serial port from entering or staying in BL
+ * BOARD_RX_BUF_SIZE       4096                -  Optional size of the USB receive ring (a multiple of the 64 byte packet size).
+ *                                                This bounds how many PROG_SEQ packets the host may have in flight over USB.
+ *                                                Default is 4096 on F4/F7 and 256 elsewhere.
+ * BOARD_TX_BUF_SIZE       256                 -  Optional size of the transmit ring of each interface. A longer reply waits for
+ *                                                room. Default is 256.
+ * BOARD_FLASH_BUFFER_SIZE 8192                -  Optional largest PROG_LARGE payload (a multiple of 4, at least 256). Default is
+ *                                                8192 on F4/F7, and with ENABLE_PROG_LARGE 2048 on F3 and 1024 on F1. Without
+ *                                                it the default is 256, a PROG_MULTI packet.
+ * ENABLE_PROG_SEQ                             -  Optional support for pipelined uploads with PROG_SEQ. Default is on for F4/F7.
+ * ENABLE_PROG_LARGE                           -  Optional support for uploads in packets of up to BOARD_FLASH_BUFFER_SIZE bytes
+ *                                                with PROG_LARGE. Default is on for F4/F7.
+ * ENABLE_PROG_ADDR                            -  Optional support for skipping erased flash in an upload with PROG_ADDR.
+ *                                                Default is on for F4/F7.
+ * ENABLE_PROG_FRAME                           -  Optional support for CRC checked PROG_SEQ packets with PROG_FRAME. Needs
+ *                                                ENABLE_PROG_SEQ. Default is on with ENABLE_PROG_SEQ for F4/F7.
+ * ENABLE_JOBS                                 -  Optional support for erasing and summing the flash in the background with
+ *                                                JOB_START and GET_STATUS. Default is on for F4/F7.
+ * ENABLE_READ_MULTI                           -  Optional support for reading back flash, OTP and UDID with READ_MULTI. The
+ *                                                flash cannot be read with ENABLE_ENCRYPTION. Default is on for F4/F7.
+ * ENABLE_SET_VERIFY                           -  Optional support for choosing when programmed data is read back with
+ *                                                SET_VERIFY, also for encrypted uploads. Default is on for F4/F7.
+ * ENABLE_SET_BAUD                             -  Optional support for changing the USART baud rate with SET_BAUD. Needs
+ *                                                INTERFACE_USART. Default is on for F4/F7 with INTERFACE_USART.
+ * ENABLE_ERASED_CRC                           -  Optional shortcut for GET_CRC after a plain upload, which works out the CRC
+ *                                                of the erased flash above the image instead of reading it. ENABLE_PROG_ADDR
+ *                                                and ENABLE_BRIDGE turn it on. Default is on for F4/F7.
+ * ENABLE_LZ4                                  -  Optional support for PROG_LZ4 compressed uploads. These are plaintext, so they
+ *                                                zero the key of a board with ENABLE_ENCRYPTION. Default is on for F4/F7
+ *                                                without ENABLE_ENCRYPTION.
+ * ENABLE_SECTOR_UPDATE                        -  Optional support for per sector CRC and erase (delta updates). Default is on
+ *                                                for F4/F7.
+ * ENABLE_RESUME                               -  Optional support for resuming an upload after a reset, with the progress kept
+ *                                                in RTC backup registers. Default is on for F4/F7.
+ * ENABLE_GET_INFO                             -  Optional support for reading all the identification data with one GET_INFO.
+ *                                                Default is on for F4/F7.
+ * ENABLE_GET_DIGEST                           -  Optional support for the CRC of any range of flash with GET_DIGEST. Not
+ *                                                allowed with ENABLE_ENCRYPTION, as the CRC of a single word gives the word
+ *                                                away. Default is on for F4/F7 without encryption.
+ * ENABLE_VERIFY_BLOCKS                        -  Optional support for comparing blocks of flash with a list of CRCs with
+ *                                                VERIFY_BLOCKS. Not allowed with ENABLE_ENCRYPTION, for the same reason as
+ *                                                ENABLE_GET_DIGEST. Default is on for F4/F7 without encryption.
+ * ENABLE_SHA256                               -  Optional support for SHA-256 in GET_DIGEST. Needs ENABLE_GET_DIGEST. Default
+ *                                                is on with ENABLE_GET_DIGEST for F4/F7.
+ * ENABLE_RAM_LOAD                             -  Optional support for loading test firmware to RAM and running it. Needs the
+ *                                                RAM window from stm32f4_ramload.ld or stm32f7.ld. Not allowed with
+ *                                                ENABLE_ENCRYPTION, as the image could read the key. Default is on for F4/F7
+ *                                                without encryption.
+ * ENABLE_PARTITIONS                           -  Optional support for reporting, erasing and checking each partition on its own.
+ *                                                Needs ENABLE_SECTOR_UPDATE. Default is on for boards with BOARD_PARTITIONS.
+ * BOARD_PARTITIONS  {"app", 0, 4}, {"romfs", 4, 0} - Optional partition table. Each entry has a name of up to 7 characters,
+ *                                                the first app sector (counted from BOARD_FIRST_FLASH_SECTOR_TO_ERASE) and
+ *                                                the number of sectors, 0 for the rest of the app area. The default is a
+ *                                                single "app" partition covering the whole app area.
+ * ENABLE_MULTIDROP                            -  Optional support for flashing several boards on one shared RS-485 or half
+ *                                                duplex USART at once with BUS_SELECT. Without BOARD_PIN_DE the USART runs
+ *                                                single wire half duplex on BOARD_PIN_TX, made open drain (on F1 the line
+ *                                                needs an external pull-up). Turns on ENABLE_PROG_SEQ and ENABLE_PROG_FRAME.
+ *                                                Default is off.
+ * BOARD_PIN_DE         GPIO8                  -  Optional driver enable of an RS-485 transceiver on the port of BOARD_PIN_TX,
+ *                                                high while ENABLE_MULTIDROP sends.
+ * BOARD_BRIDGE_USART   USART6                 -  Optional USART to the bootloader of a second MCU (px4io) that the BRIDGE_
+ *                                                commands flash. Needs BOARD_BRIDGE_CLOCK_REGISTER, BOARD_BRIDGE_CLOCK_BIT,
+ *                                                BOARD_PORT_BRIDGE, BOARD_PORT_BRIDGE_AF, BOARD_PIN_BRIDGE_TX,
+ *                                                BOARD_PIN_BRIDGE_RX, BOARD_BRIDGE_PIN_CLOCK_REGISTER and
+ *                                                BOARD_BRIDGE_PIN_CLOCK_BIT as for BOARD_USART, and turns on ENABLE_BRIDGE.
+ * BRIDGE_BAUDRATE      115200                 -  Optional baud rate of BOARD_BRIDGE_USART. Default is 115200.
+ * BOARD_USART_DMA      DMA1                   -  Optional DMA controller for receiving on BOARD_USART (F4/F7 only), so that bytes
+ *                                                arriving while the CPU is stalled on flash are kept. Needs
+ *                                                BOARD_USART_DMA_STREAM, BOARD_USART_DMA_CHANNEL and BOARD_USART_DMA_CLOCK_BIT
+ *                                                (in RCC_AHB1ENR), e.g. DMA_STREAM5, DMA_SxCR_CHSEL_4 and RCC_AHB1ENR_DMA1EN.
+ * BOARD_USART_DMA_BUF_SIZE 1024               -  Optional size of the DMA receive ring. Default is 1024. A command during
+ *                                                which the ring overflows gets INVALID.
+ * BOARD_PIN_RTS        GPIO12                 -  Optional RTS and CTS pins of BOARD_USART on BOARD_PORT_USART (on
+ * BOARD_PIN_CTS        GPIO11                    BOARD_PORT_USART_FLOW for F7), for flow control at the rates chosen with
+ *                                                SET_BAUD. Not supported on F1.
  *
  * * Other defines are somewhat self explanatory.
  */
@@ -144,6 +219,18 @@
 # define BOARD_USART_PIN_CLOCK_REGISTER RCC_AHB1ENR
 # define BOARD_USART_PIN_CLOCK_BIT  	RCC_AHB1ENR_IOPDEN
 
+/* px4io */
+# define BOARD_BRIDGE_USART  			USART6
+# define BOARD_BRIDGE_CLOCK_REGISTER 	RCC_APB2ENR
+# define BOARD_BRIDGE_CLOCK_BIT      	RCC_APB2ENR_USART6EN
+
+# define BOARD_PORT_BRIDGE   			GPIOC
+# define BOARD_PORT_BRIDGE_AF 			GPIO_AF8
+# define BOARD_PIN_BRIDGE_TX     		GPIO6
+# define BOARD_PIN_BRIDGE_RX	     		GPIO7
+# define BOARD_BRIDGE_PIN_CLOCK_REGISTER RCC_AHB1ENR
+# define BOARD_BRIDGE_PIN_CLOCK_BIT  	RCC_AHB1ENR_IOPCEN
+
 /*
  * Uncommenting this allows to force the bootloader through
  * a PWM output pin. As this can accidentally initialize
@@ -484,6 +571,11 @@
 # define BOARD_PIO
 # define INTERFACE_USB                	0
 # define INTERFACE_USART                1
+# define ENABLE_SET_VERIFY
+# define ENABLE_SET_BAUD
+# define ENABLE_PROG_LARGE
+# define ENABLE_LZ4
+# define BOARD_FLASH_BUFFER_SIZE        1024
 # define USBDEVICESTRING                ""
 # define USBPRODUCTID                   -1
 
@@ -586,6 +678,11 @@
 # define BOARD_USART_PIN_CLOCK_REGISTER RCC_AHB1ENR
 # define BOARD_USART_PIN_CLOCK_BIT  	RCC_AHB1ENR_IOPAEN
 
+# define BOARD_USART_DMA                DMA1            /* USART2 RX */
+# define BOARD_USART_DMA_STREAM         DMA_STREAM5
+# define BOARD_USART_DMA_CHANNEL        DMA_SxCR_CHSEL_4
+# define BOARD_USART_DMA_CLOCK_BIT      RCC_AHB1ENR_DMA1EN
+
 # define BOARD_PIN_LED_ACTIVITY         GPIO4
 # define BOARD_PIN_LED_BOOTLOADER       GPIO5
 # define BOARD_PORT_LEDS                GPIOC
@@ -654,6 +751,11 @@
 # define BOARD_USART_PIN_CLOCK_REGISTER RCC_AHB1ENR
 # define BOARD_USART_PIN_CLOCK_BIT  	RCC_AHB1ENR_IOPAEN
 
+# define BOARD_USART_DMA                DMA1            /* USART2 RX */
+# define BOARD_USART_DMA_STREAM         DMA_STREAM5
+# define BOARD_USART_DMA_CHANNEL        DMA_SxCR_CHSEL_4
+# define BOARD_USART_DMA_CLOCK_BIT      RCC_AHB1ENR_DMA1EN
+
 # define BOARD_PIN_LED_ACTIVITY         GPIO4
 # define BOARD_PIN_LED_BOOTLOADER       GPIO5
 # define BOARD_PORT_LEDS                GPIOC
@@ -871,6 +973,11 @@
 # define BOARD_USART_PIN_CLOCK_REGISTER		RCC_AHB1ENR
 # define BOARD_USART_PIN_CLOCK_BIT		RCC_AHB1ENR_IOPAEN
 
+# define BOARD_USART_DMA			DMA1		/* USART2 RX */
+# define BOARD_USART_DMA_STREAM		DMA_STREAM5
+# define BOARD_USART_DMA_CHANNEL		DMA_SxCR_CHSEL_4
+# define BOARD_USART_DMA_CLOCK_BIT	RCC_AHB1ENR_DMA1EN
+
 # define BOARD_FORCE_BL_PIN			GPIO11
 # define BOARD_FORCE_BL_PORT			GPIOA
 # define BOARD_FORCE_BL_CLOCK_REGISTER		RCC_AHB1ENR
@@ -892,6 +999,8 @@
 # define INTERFACE_USB                  0
 # define INTERFACE_USART                1
 # define OVERRIDE_USART_BAUDRATE        500000
+# define ENABLE_SET_VERIFY
+# define ENABLE_SET_BAUD
 # define USBDEVICESTRING                ""
 # define USBPRODUCTID                   -1
 
@@ -948,6 +1057,114 @@
 #  define BOARD_FIRST_FLASH_SECTOR_TO_ERASE 0
 #endif
 
+#if !defined(BOARD_RX_BUF_SIZE)
+#  if defined(STM32F4)
+#    define BOARD_RX_BUF_SIZE 4096
+#  else
+#    define BOARD_RX_BUF_SIZE 256
+#  endif
+#endif
+
+#if !defined(BOARD_TX_BUF_SIZE)
+#  define BOARD_TX_BUF_SIZE 256
+#endif
+
+#if (defined(STM32F4) || defined(ENABLE_MULTIDROP)) && !defined(ENABLE_PROG_SEQ)
+#  define ENABLE_PROG_SEQ
+#endif
+
+#if (defined(STM32F4) || defined(ENABLE_MULTIDROP)) && defined(ENABLE_PROG_SEQ) && !defined(ENABLE_PROG_FRAME)
+#  define ENABLE_PROG_FRAME
+#endif
+
+#if defined(STM32F4) && !defined(ENABLE_JOBS)
+#  define ENABLE_JOBS
+#endif
+
+#if defined(STM32F4) && !defined(ENABLE_READ_MULTI)
+#  define ENABLE_READ_MULTI
+#endif
+
+#if defined(STM32F4) && !defined(ENABLE_SET_VERIFY)
+#  define ENABLE_SET_VERIFY
+#endif
+
+#if defined(STM32F4) && INTERFACE_USART && !defined(ENABLE_SET_BAUD)
+#  define ENABLE_SET_BAUD
+#endif
+
+#if defined(STM32F4) && !defined(ENABLE_PROG_LARGE)
+#  define ENABLE_PROG_LARGE
+#endif
+
+#if defined(STM32F4) && !defined(ENABLE_PROG_ADDR)
+#  define ENABLE_PROG_ADDR
+#endif
+
+#if !defined(BOARD_FLASH_BUFFER_SIZE)
+#  if defined(STM32F4)
+#    define BOARD_FLASH_BUFFER_SIZE 8192
+#  elif !defined(ENABLE_PROG_LARGE)
+#    define BOARD_FLASH_BUFFER_SIZE 256
+#  elif defined(STM32F3)
+#    define BOARD_FLASH_BUFFER_SIZE 2048
+#  else
+#    define BOARD_FLASH_BUFFER_SIZE 1024
+#  endif
+#endif
+
+#if defined(STM32F4) && !defined(ENABLE_ENCRYPTION) && !defined(ENABLE_LZ4)
+#  define ENABLE_LZ4
+#endif
+
+#if defined(STM32F4) && !defined(ENABLE_SECTOR_UPDATE)
+#  define ENABLE_SECTOR_UPDATE
+#endif
+
+#if defined(STM32F4) && !defined(ENABLE_RESUME)
+#  define ENABLE_RESUME
+#endif
+
+#if defined(STM32F4) && !defined(ENABLE_GET_INFO)
+#  define ENABLE_GET_INFO
+#endif
+
+#if defined(STM32F4) && !defined(ENABLE_ENCRYPTION) && !defined(ENABLE_GET_DIGEST)
+#  define ENABLE_GET_DIGEST
+#endif
+
+#if defined(STM32F4) && !defined(ENABLE_ENCRYPTION) && !defined(ENABLE_VERIFY_BLOCKS)
+#  define ENABLE_VERIFY_BLOCKS
+#endif
+
+#if defined(STM32F4) && defined(ENABLE_GET_DIGEST) && !defined(ENABLE_SHA256)
+#  define ENABLE_SHA256
+#endif
+
+#if defined(STM32F4) && !defined(ENABLE_ENCRYPTION) && !defined(ENABLE_RAM_LOAD)
+#  define ENABLE_RAM_LOAD
+#endif
+
+#if defined(BOARD_PARTITIONS) && defined(ENABLE_SECTOR_UPDATE) && !defined(ENABLE_PARTITIONS)
+#  define ENABLE_PARTITIONS
+#endif
+
+#if defined(BOARD_BRIDGE_USART) && !defined(ENABLE_BRIDGE)
+#  define ENABLE_BRIDGE
+#endif
+
+#if (defined(STM32F4) || defined(ENABLE_PROG_ADDR) || defined(ENABLE_BRIDGE)) && !defined(ENABLE_ERASED_CRC)
+#  define ENABLE_ERASED_CRC
+#endif
+
+#if defined(BOARD_USART_DMA) && !defined(BOARD_USART_DMA_BUF_SIZE)
+#  define BOARD_USART_DMA_BUF_SIZE 1024
+#endif
+
+#if defined(BOARD_BRIDGE_USART) && !defined(BRIDGE_BAUDRATE)
+#  define BRIDGE_BAUDRATE 115200
+#endif
+
 #if defined(OVERRIDE_USART_BAUDRATE)
 #  define USART_BAUDRATE OVERRIDE_USART_BAUDRATE
 #else
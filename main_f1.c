@@ -68,10 +68,26 @@ board_init(void)
 #ifdef INTERFACE_USART
 	/* configure usart pins */
 	rcc_peripheral_enable_clock(&BOARD_USART_PIN_CLOCK_REGISTER, BOARD_USART_PIN_CLOCK_BIT);
+#  if defined(ENABLE_MULTIDROP) && !defined(BOARD_PIN_DE)
+	/* single wire half duplex, TX only ever pulls the shared line low */
+	gpio_set_mode(BOARD_PORT_USART,
+		      GPIO_MODE_OUTPUT_50_MHZ,
+		      GPIO_CNF_OUTPUT_ALTFN_OPENDRAIN,
+		      BOARD_PIN_TX);
+#  else
 	gpio_set_mode(BOARD_PORT_USART,
 		      GPIO_MODE_OUTPUT_50_MHZ,
 		      GPIO_CNF_OUTPUT_ALTFN_PUSHPULL,
 		      BOARD_PIN_TX);
+#  endif
+#  if defined(ENABLE_MULTIDROP) && defined(BOARD_PIN_DE)
+	/* RS-485 driver enable, off until there is something to send */
+	gpio_clear(BOARD_PORT_USART, BOARD_PIN_DE);
+	gpio_set_mode(BOARD_PORT_USART,
+		      GPIO_MODE_OUTPUT_50_MHZ,
+		      GPIO_CNF_OUTPUT_PUSHPULL,
+		      BOARD_PIN_DE);
+#  endif
 
 	/* configure USART clock */
 	rcc_peripheral_enable_clock(&BOARD_USART_CLOCK_REGISTER, BOARD_USART_CLOCK_BIT);
@@ -108,6 +124,12 @@ board_deinit(void)
 		      GPIO_MODE_INPUT,
 		      GPIO_CNF_INPUT_FLOAT,
 		      BOARD_PIN_TX);
+#  if defined(ENABLE_MULTIDROP) && defined(BOARD_PIN_DE)
+	gpio_set_mode(BOARD_PORT_USART,
+		      GPIO_MODE_INPUT,
+		      GPIO_CNF_INPUT_FLOAT,
+		      BOARD_PIN_DE);
+#  endif
 
 	/* disable USART peripheral clock */
 	rcc_peripheral_disable_clock(&BOARD_USART_CLOCK_REGISTER, BOARD_USART_CLOCK_BIT);
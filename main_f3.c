@@ -169,6 +169,22 @@ board_init(void)
 	gpio_set_af(BOARD_PORT_USART, BOARD_PORT_USART_AF, BOARD_PIN_TX);
 	gpio_set_af(BOARD_PORT_USART, BOARD_PORT_USART_AF, BOARD_PIN_RX);
 
+#  if defined(ENABLE_MULTIDROP) && defined(BOARD_PIN_DE)
+	/* RS-485 driver enable, off until there is something to send */
+	gpio_clear(BOARD_PORT_USART, BOARD_PIN_DE);
+	gpio_mode_setup(BOARD_PORT_USART, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, BOARD_PIN_DE);
+#  elif defined(ENABLE_MULTIDROP)
+	/* single wire half duplex, TX only ever pulls the shared line low */
+	gpio_set_output_options(BOARD_PORT_USART, GPIO_OTYPE_OD, GPIO_OSPEED_50MHZ, BOARD_PIN_TX);
+#  endif
+
+#  if defined(BOARD_PIN_RTS) && defined(BOARD_PIN_CTS)
+	/* Setup the flow control pins for SET_BAUD */
+	gpio_mode_setup(BOARD_PORT_USART, GPIO_MODE_AF, GPIO_PUPD_PULLUP, BOARD_PIN_RTS | BOARD_PIN_CTS);
+	gpio_set_af(BOARD_PORT_USART, BOARD_PORT_USART_AF, BOARD_PIN_RTS);
+	gpio_set_af(BOARD_PORT_USART, BOARD_PORT_USART_AF, BOARD_PIN_CTS);
+#  endif
+
 	/* configure USART clock */
 	rcc_peripheral_enable_clock(&BOARD_USART_CLOCK_REGISTER, BOARD_USART_CLOCK_BIT);
 #endif
@@ -197,6 +213,12 @@ board_deinit(void)
 #ifdef INTERFACE_USART
 	/* deinitialise GPIO pins for USART transmit. */
 	gpio_mode_setup(BOARD_PORT_USART, GPIO_MODE_INPUT, GPIO_PUPD_NONE, BOARD_PIN_TX | BOARD_PIN_RX);
+#  if defined(BOARD_PIN_RTS) && defined(BOARD_PIN_CTS)
+	gpio_mode_setup(BOARD_PORT_USART, GPIO_MODE_INPUT, GPIO_PUPD_NONE, BOARD_PIN_RTS | BOARD_PIN_CTS);
+#  endif
+#  if defined(ENABLE_MULTIDROP) && defined(BOARD_PIN_DE)
+	gpio_mode_setup(BOARD_PORT_USART, GPIO_MODE_INPUT, GPIO_PUPD_NONE, BOARD_PIN_DE);
+#  endif
 
 	/* disable USART peripheral clock */
 	rcc_peripheral_disable_clock(&BOARD_USART_CLOCK_REGISTER, BOARD_USART_CLOCK_BIT);
@@ -173,6 +173,7 @@ static void board_init(void);
 #define BOOT_RTC_SIGNATURE          0xb007b007
 #define POWER_DOWN_RTC_SIGNATURE    0xdeaddead // Written by app fw to not re-power on.
 #define BOOT_RTC_REG                MMIO32(RTC_BASE + 0x50)
+#define BACKUP_REG(n)               MMIO32(RTC_BASE + 0x90 + ((n) * 4)) /* RTC_BKP16R onwards, clear of the app */
 
 /* standard clocking for all F7 boards */
 static const struct rcc_clock_scale clock_setup = {
@@ -220,6 +221,46 @@ board_set_rtc_signature(uint32_t sig)
 	PWR_CR &= ~PWR_CR_DBP;
 }
 
+#if defined(ENABLE_RESUME)
+uint32_t
+board_get_backup_reg(unsigned reg)
+{
+	if (reg >= BOARD_BACKUP_REGS) {
+		return 0;
+	}
+
+	/* enable the backup registers */
+	PWR_CR |= PWR_CR_DBP;
+	RCC_BDCR |= RCC_BDCR_RTCEN;
+
+	uint32_t result = BACKUP_REG(reg);
+
+	/* disable the backup registers */
+	RCC_BDCR &= ~RCC_BDCR_RTCEN;
+	PWR_CR &= ~PWR_CR_DBP;
+
+	return result;
+}
+
+void
+board_set_backup_reg(unsigned reg, uint32_t value)
+{
+	if (reg >= BOARD_BACKUP_REGS) {
+		return;
+	}
+
+	/* enable the backup registers */
+	PWR_CR |= PWR_CR_DBP;
+	RCC_BDCR |= RCC_BDCR_RTCEN;
+
+	BACKUP_REG(reg) = value;
+
+	/* disable the backup registers */
+	RCC_BDCR &= ~RCC_BDCR_RTCEN;
+	PWR_CR &= ~PWR_CR_DBP;
+}
+#endif
+
 static bool
 board_test_force_pin()
 {
@@ -384,8 +425,36 @@ board_init(void)
 	gpio_set_af(BOARD_PORT_USART_TX, BOARD_PORT_USART_AF, BOARD_PIN_TX);
 	gpio_set_af(BOARD_PORT_USART_RX, BOARD_PORT_USART_AF, BOARD_PIN_RX);
 
+#  if defined(ENABLE_MULTIDROP) && defined(BOARD_PIN_DE)
+	/* RS-485 driver enable, off until there is something to send */
+	gpio_clear(BOARD_PORT_USART_TX, BOARD_PIN_DE);
+	gpio_mode_setup(BOARD_PORT_USART_TX, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, BOARD_PIN_DE);
+#  elif defined(ENABLE_MULTIDROP)
+	/* single wire half duplex, TX only ever pulls the shared line low */
+	gpio_set_output_options(BOARD_PORT_USART_TX, GPIO_OTYPE_OD, GPIO_OSPEED_50MHZ, BOARD_PIN_TX);
+#  endif
+
+#  if defined(BOARD_PIN_RTS) && defined(BOARD_PIN_CTS)
+	/* Setup the flow control pins for SET_BAUD */
+	gpio_mode_setup(BOARD_PORT_USART_FLOW, GPIO_MODE_AF, GPIO_PUPD_PULLUP, BOARD_PIN_RTS | BOARD_PIN_CTS);
+	gpio_set_af(BOARD_PORT_USART_FLOW, BOARD_PORT_USART_AF, BOARD_PIN_RTS);
+	gpio_set_af(BOARD_PORT_USART_FLOW, BOARD_PORT_USART_AF, BOARD_PIN_CTS);
+#  endif
+
 	/* configure USART clock */
 	rcc_peripheral_enable_clock(&BOARD_USART_CLOCK_REGISTER, BOARD_USART_CLOCK_BIT);
+#  if defined(BOARD_USART_DMA)
+	rcc_peripheral_enable_clock(&RCC_AHB1ENR, BOARD_USART_DMA_CLOCK_BIT);
+#  endif
+#endif
+
+#if defined(BOARD_BRIDGE_USART)
+	/* configure the pins and clock of the USART to the second MCU */
+	rcc_peripheral_enable_clock(&BOARD_BRIDGE_PIN_CLOCK_REGISTER, BOARD_BRIDGE_PIN_CLOCK_BIT);
+	gpio_mode_setup(BOARD_PORT_BRIDGE, GPIO_MODE_AF, GPIO_PUPD_PULLUP, BOARD_PIN_BRIDGE_TX | BOARD_PIN_BRIDGE_RX);
+	gpio_set_af(BOARD_PORT_BRIDGE, BOARD_PORT_BRIDGE_AF, BOARD_PIN_BRIDGE_TX);
+	gpio_set_af(BOARD_PORT_BRIDGE, BOARD_PORT_BRIDGE_AF, BOARD_PIN_BRIDGE_RX);
+	rcc_peripheral_enable_clock(&BOARD_BRIDGE_CLOCK_REGISTER, BOARD_BRIDGE_CLOCK_BIT);
 #endif
 
 #if defined(BOARD_FORCE_BL_PIN_IN) && defined(BOARD_FORCE_BL_PIN_OUT)
@@ -430,9 +499,24 @@ board_deinit(void)
 	/* deinitialise GPIO pins for USART transmit. */
 	gpio_mode_setup(BOARD_PORT_USART_TX, GPIO_MODE_INPUT, GPIO_PUPD_NONE, BOARD_PIN_TX);
 	gpio_mode_setup(BOARD_PORT_USART_RX, GPIO_MODE_INPUT, GPIO_PUPD_NONE, BOARD_PIN_RX);
+#  if defined(BOARD_PIN_RTS) && defined(BOARD_PIN_CTS)
+	gpio_mode_setup(BOARD_PORT_USART_FLOW, GPIO_MODE_INPUT, GPIO_PUPD_NONE, BOARD_PIN_RTS | BOARD_PIN_CTS);
+#  endif
+#  if defined(ENABLE_MULTIDROP) && defined(BOARD_PIN_DE)
+	gpio_mode_setup(BOARD_PORT_USART_TX, GPIO_MODE_INPUT, GPIO_PUPD_NONE, BOARD_PIN_DE);
+#  endif
 
 	/* disable USART peripheral clock */
 	rcc_peripheral_disable_clock(&BOARD_USART_CLOCK_REGISTER, BOARD_USART_CLOCK_BIT);
+#  if defined(BOARD_USART_DMA)
+	rcc_peripheral_disable_clock(&RCC_AHB1ENR, BOARD_USART_DMA_CLOCK_BIT);
+#  endif
+#endif
+
+#if defined(BOARD_BRIDGE_USART)
+	/* deinitialise the USART to the second MCU */
+	gpio_mode_setup(BOARD_PORT_BRIDGE, GPIO_MODE_INPUT, GPIO_PUPD_NONE, BOARD_PIN_BRIDGE_TX | BOARD_PIN_BRIDGE_RX);
+	rcc_peripheral_disable_clock(&BOARD_BRIDGE_CLOCK_REGISTER, BOARD_BRIDGE_CLOCK_BIT);
 #endif
 
 #if defined(BOARD_FORCE_BL_PIN_IN) && defined(BOARD_FORCE_BL_PIN_OUT)
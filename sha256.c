@@ -0,0 +1,192 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2017 PX4 Development Team. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+/**
+ * @file sha256.c
+ *
+ * Streaming SHA-256 (FIPS 180-4).
+ *
+ * The message schedule is kept as a rolling window of 16 words rather
+ * than the full 64, which saves stack and costs nothing in speed. Whole
+ * blocks are hashed straight from the caller's data without being
+ * copied into the context first.
+ */
+
+#include "hw_config.h"
+
+#if defined(ENABLE_SHA256)
+
+#include "sha256.h"
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+#define CH(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)	(((x) & (y)) | ((z) & ((x) | (y))))
+#define EP0(x)		(ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define EP1(x)		(ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define SIG0(x)		(ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define SIG1(x)		(ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void
+sha256_block(uint32_t *state, const uint8_t *p)
+{
+	uint32_t w[16];
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (unsigned i = 0; i < 64; i++) {
+		uint32_t x;
+
+		if (i < 16) {
+			x = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+			p += 4;
+
+		} else {
+			x = SIG1(w[(i - 2) & 15]) + w[(i - 7) & 15] + SIG0(w[(i - 15) & 15]) + w[i & 15];
+		}
+
+		w[i & 15] = x;
+
+		uint32_t t1 = h + EP1(e) + CH(e, f, g) + k[i] + x;
+		uint32_t t2 = EP0(a) + MAJ(a, b, c);
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void
+sha256_init(sha256_t *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	for (unsigned i = 0; i < 8; i++) {
+		ctx->state[i] = iv[i];
+	}
+
+	ctx->count = 0;
+}
+
+void
+sha256_update(sha256_t *ctx, const uint8_t *data, unsigned len)
+{
+	unsigned fill = ctx->count & 63;
+
+	ctx->count += len;
+
+	// top up a partial block first
+	if (fill > 0) {
+		while (len > 0 && fill < 64) {
+			ctx->block[fill++] = *data++;
+			len--;
+		}
+
+		if (fill < 64) {
+			return;
+		}
+
+		sha256_block(ctx->state, ctx->block);
+	}
+
+	for (; len >= 64; len -= 64, data += 64) {
+		sha256_block(ctx->state, data);
+	}
+
+	for (unsigned i = 0; i < len; i++) {
+		ctx->block[i] = data[i];
+	}
+}
+
+void
+sha256_final(sha256_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	uint32_t bits = ctx->count * 8;
+	unsigned fill = ctx->count & 63;
+
+	// pad with 0x80 then zeros up to the 64 bit length
+	ctx->block[fill++] = 0x80;
+
+	if (fill > 56) {
+		while (fill < 64) {
+			ctx->block[fill++] = 0;
+		}
+
+		sha256_block(ctx->state, ctx->block);
+		fill = 0;
+	}
+
+	while (fill < 60) {
+		ctx->block[fill++] = 0;
+	}
+
+	// the upper length word stays 0, images are far below 512MiB
+	for (unsigned i = 0; i < 4; i++) {
+		ctx->block[60 + i] = bits >> (24 - i * 8);
+	}
+
+	sha256_block(ctx->state, ctx->block);
+
+	for (unsigned i = 0; i < SHA256_DIGEST_SIZE; i++) {
+		digest[i] = ctx->state[i / 4] >> (24 - (i & 3) * 8);
+	}
+}
+
+#endif
@@ -43,3 +43,18 @@ extern void uart_cinit(void *config);
 extern void uart_cfini(void);
 extern int uart_cin(void);
 extern void uart_cout(uint8_t *buf, unsigned len);
+extern bool uart_tx_done(void);
+extern bool uart_check_baudrate(uint32_t baud);
+extern bool uart_set_baudrate(uint32_t baud, bool flow_control);
+extern uint32_t uart_get_baudrate(void);
+extern bool uart_get_flow_control(void);
+#if defined(BOARD_USART_DMA)
+extern bool uart_rx_overrun(void);
+#endif
+
+#if defined(BOARD_BRIDGE_USART)
+extern void bridge_cinit(void);
+extern void bridge_cfini(void);
+extern int bridge_cin(void);
+extern void bridge_cout(uint8_t *buf, unsigned len);
+#endif
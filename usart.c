@@ -38,20 +38,96 @@
 #if !defined(USART_SR)
 #define USART_SR USART_ISR
 #endif
+#if defined(BOARD_USART_DMA)
+# include <libopencm3/stm32/dma.h>
+#endif
+
 #include "bl.h"
 #include "uart.h"
 
+/* because libopencm3 doesn't know the OVER8 bit, which the F1 lacks */
+#define UART_CR1_OVER8	(1 << 15)
+
 uint32_t usart;
+static uint32_t uart_baudrate;
+static bool uart_flow_control;
+
+/*
+ * Transmit ring. uart_cout() only queues, and the ring is drained into the
+ * data register whenever it is free while the bootloader polls for input,
+ * so a reply goes out while the next command is coming in.
+ */
+static uint8_t uart_tx_ring[BOARD_TX_BUF_SIZE];
+static unsigned uart_tx_head, uart_tx_tail;
+
+#if defined(ENABLE_MULTIDROP)
+/*
+ * On a shared bus the USART drives the line only while it has something
+ * to send, through the transceiver's driver enable on BOARD_PIN_DE, else
+ * in single wire half duplex mode with the TX pin open drain. Either way
+ * the receiver is off meanwhile so that the node does not hear itself.
+ */
+static bool uart_bus_driving;
+
+#  if defined(BOARD_PORT_USART_TX)
+#    define UART_PORT_DE	BOARD_PORT_USART_TX
+#  else
+#    define UART_PORT_DE	BOARD_PORT_USART
+#  endif
+
+static void
+uart_bus_drive(bool on)
+{
+	if (on) {
+		USART_CR1(usart) &= ~USART_CR1_RE;
+#  if defined(BOARD_PIN_DE)
+		gpio_set(UART_PORT_DE, BOARD_PIN_DE);
+#  endif
+
+	} else {
+#  if defined(BOARD_PIN_DE)
+		gpio_clear(UART_PORT_DE, BOARD_PIN_DE);
+#  endif
+		USART_CR1(usart) |= USART_CR1_RE;
+	}
+
+	uart_bus_driving = on;
+}
+#endif
+
+#if defined(BOARD_USART_DMA)
+/*
+ * Receive ring filled by circular DMA. The DMA keeps running while the
+ * CPU is stalled on a flash write or erase, and the write position is
+ * read back from the stream's count, so no interrupt is needed.
+ *
+ * If the DMA writes over bytes not read yet, or laps the ring between two
+ * looks, the half and complete transfer flags or the distance moved give
+ * it away. The unread bytes are dropped and uart_rx_overrun() reports it.
+ */
+static uint8_t uart_rx_ring[BOARD_USART_DMA_BUF_SIZE];
+static unsigned uart_rx_tail;
+static unsigned uart_rx_head;	/* DMA write position at the last look */
+static bool uart_rx_lost;
+
+#  if defined(USART_RDR)
+#    define UART_RX_REG	USART_RDR(usart)
+#  else
+#    define UART_RX_REG	USART_DR(usart)
+#  endif
+#endif
 
 void
 uart_cinit(void *config)
 {
 	usart = (uint32_t)config;
+	uart_baudrate = USART_BAUDRATE;
+	uart_flow_control = false;
+	uart_tx_head = uart_tx_tail = 0;
 
 	/* board is expected to do pin and clock setup */
 
 	/* do usart setup */
-	//USART_CR1(usart) |= (1 << 15);	/* because libopencm3 doesn't know the OVER8 bit */
 	usart_set_baudrate(usart, USART_BAUDRATE);
 	usart_set_databits(usart, 8);
 	usart_set_stopbits(usart, USART_STOPBITS_1);
@@ -59,6 +135,34 @@ uart_cinit(void *config)
 	usart_set_parity(usart, USART_PARITY_NONE);
 	usart_set_flow_control(usart, USART_FLOWCONTROL_NONE);
 
+#if defined(ENABLE_MULTIDROP) && !defined(BOARD_PIN_DE)
+	/* TX and RX share the TX pin, which the board makes open drain */
+	USART_CR3(usart) |= USART_CR3_HDSEL;
+#endif
+#if defined(ENABLE_MULTIDROP)
+	uart_bus_driving = false;
+#endif
+
+#if defined(BOARD_USART_DMA)
+	/* board is expected to enable the DMA clock as well */
+	dma_stream_reset(BOARD_USART_DMA, BOARD_USART_DMA_STREAM);
+	dma_set_peripheral_address(BOARD_USART_DMA, BOARD_USART_DMA_STREAM, (uint32_t)&UART_RX_REG);
+	dma_set_memory_address(BOARD_USART_DMA, BOARD_USART_DMA_STREAM, (uint32_t)uart_rx_ring);
+	dma_set_number_of_data(BOARD_USART_DMA, BOARD_USART_DMA_STREAM, sizeof(uart_rx_ring));
+	dma_channel_select(BOARD_USART_DMA, BOARD_USART_DMA_STREAM, BOARD_USART_DMA_CHANNEL);
+	dma_set_transfer_mode(BOARD_USART_DMA, BOARD_USART_DMA_STREAM, DMA_SxCR_DIR_PERIPHERAL_TO_MEM);
+	dma_set_peripheral_size(BOARD_USART_DMA, BOARD_USART_DMA_STREAM, DMA_SxCR_PSIZE_8BIT);
+	dma_set_memory_size(BOARD_USART_DMA, BOARD_USART_DMA_STREAM, DMA_SxCR_MSIZE_8BIT);
+	dma_enable_memory_increment_mode(BOARD_USART_DMA, BOARD_USART_DMA_STREAM);
+	dma_enable_circular_mode(BOARD_USART_DMA, BOARD_USART_DMA_STREAM);
+	dma_enable_stream(BOARD_USART_DMA, BOARD_USART_DMA_STREAM);
+
+	uart_rx_tail = 0;
+	uart_rx_head = 0;
+	uart_rx_lost = false;
+	usart_enable_rx_dma(usart);
+#endif
+
 	/* and enable */
 	usart_enable(usart);
 
@@ -81,25 +185,283 @@ uart_cinit(void *config)
 void
 uart_cfini(void)
 {
+#if defined(ENABLE_MULTIDROP)
+
+	if (uart_bus_driving) {
+		uart_bus_drive(false);
+	}
+
+#endif
+#if defined(BOARD_USART_DMA)
+	usart_disable_rx_dma(usart);
+	dma_disable_stream(BOARD_USART_DMA, BOARD_USART_DMA_STREAM);
+#endif
 	usart_disable(usart);
 }
 
+/* move queued bytes to the USART for as long as it will take them */
+static void
+uart_tx_pump(void)
+{
+	while (uart_tx_tail != uart_tx_head && (USART_SR(usart) & USART_SR_TXE)) {
+#if defined(ENABLE_MULTIDROP)
+
+		if (!uart_bus_driving) {
+			uart_bus_drive(true);
+		}
+
+#endif
+		usart_send(usart, uart_tx_ring[uart_tx_tail]);
+		uart_tx_tail = (uart_tx_tail + 1) % sizeof(uart_tx_ring);
+	}
+
+#if defined(ENABLE_MULTIDROP)
+
+	// let go of the bus once the last stop bit is out
+	if (uart_bus_driving && uart_tx_tail == uart_tx_head && (USART_SR(usart) & USART_SR_TC)) {
+		uart_bus_drive(false);
+	}
+
+#endif
+}
+
+#if defined(BOARD_USART_DMA)
+/*
+ * Whether the DMA write position reached ring offset pos (0 for the end)
+ * when it moved on by moved bytes from the last look.
+ */
+static bool
+uart_rx_passed(unsigned pos, unsigned moved)
+{
+	const unsigned size = sizeof(uart_rx_ring);
+
+	return (pos + size - uart_rx_head - 1) % size < moved;
+}
+
+/*
+ * Report, once, that received bytes were lost since the last call.
+ */
+bool
+uart_rx_overrun(void)
+{
+	bool lost = uart_rx_lost;
+
+	uart_rx_lost = false;
+	return lost;
+}
+#endif
+
 int
 uart_cin(void)
 {
 	int c = -1;
 
+	uart_tx_pump();
+
+#if defined(BOARD_USART_DMA)
+	const unsigned size = sizeof(uart_rx_ring);
+
+	// take the flags before the position, so that a boundary crossed in
+	// between shows up in the position and not as a lap
+	bool half = dma_get_interrupt_flag(BOARD_USART_DMA, BOARD_USART_DMA_STREAM, DMA_HTIF);
+	bool full = dma_get_interrupt_flag(BOARD_USART_DMA, BOARD_USART_DMA_STREAM, DMA_TCIF);
+	dma_clear_interrupt_flags(BOARD_USART_DMA, BOARD_USART_DMA_STREAM, DMA_HTIF | DMA_TCIF);
+
+	unsigned head = size - DMA_SNDTR(BOARD_USART_DMA, BOARD_USART_DMA_STREAM);
+
+	// the count reloads as it reaches 0
+	if (head == size) {
+		head = 0;
+	}
+
+	unsigned unread = (uart_rx_head + size - uart_rx_tail) % size;
+	unsigned moved = (head + size - uart_rx_head) % size;
+
+	// a flagged boundary off the shortest way means a whole lap more
+	if ((half && !uart_rx_passed(size / 2, moved)) ||
+	    (full && !uart_rx_passed(0, moved)) ||
+	    moved >= size - unread) {
+		uart_rx_tail = head;
+		uart_rx_lost = true;
+	}
+
+	uart_rx_head = head;
+
+	if (uart_rx_tail != head) {
+		c = uart_rx_ring[uart_rx_tail];
+		uart_rx_tail = (uart_rx_tail + 1) % sizeof(uart_rx_ring);
+	}
+
+#else
+
 	if (USART_SR(usart) & USART_SR_RXNE) {
 		c = usart_recv(usart);
 	}
 
+#endif
 	return c;
 }
 
 void
 uart_cout(uint8_t *buf, unsigned len)
+{
+	while (len) {
+		unsigned next = (uart_tx_head + 1) % sizeof(uart_tx_ring);
+
+		// only wait when the ring is full
+		if (next == uart_tx_tail) {
+			uart_tx_pump();
+			continue;
+		}
+
+		uart_tx_ring[uart_tx_head] = *buf++;
+		uart_tx_head = next;
+		len--;
+	}
+
+	uart_tx_pump();
+}
+
+/**
+ * Check whether everything queued by uart_cout() has left the USART,
+ * sending more of it if not.
+ *
+ * @return true once the last stop bit is out (TC)
+ */
+bool
+uart_tx_done(void)
+{
+	uart_tx_pump();
+
+	return uart_tx_tail == uart_tx_head && (USART_SR(usart) & USART_SR_TC);
+}
+
+static uint32_t
+uart_clock(void)
+{
+#if defined(USART6)
+
+	if (usart == USART6) {
+		return rcc_apb2_frequency;
+	}
+
+#endif
+
+	if (usart == USART1) {
+		return rcc_apb2_frequency;
+	}
+
+	return rcc_apb1_frequency;
+}
+
+/**
+ * Check that a baud rate can be set.
+ *
+ * Rates up to the peripheral clock / 16 use 16x oversampling, and up to
+ * clock / 8 use OVER8 where the USART has it.
+ */
+bool
+uart_check_baudrate(uint32_t baud)
+{
+#if defined(STM32F1)
+	return baud >= 1200 && baud <= uart_clock() / 16;
+#else
+	return baud >= 1200 && baud <= uart_clock() / 8;
+#endif
+}
+
+/**
+ * Change the baud rate and flow control once the last byte has gone out.
+ *
+ * @return false, leaving the USART as it was, if the rate is out of range
+ */
+bool
+uart_set_baudrate(uint32_t baud, bool flow_control)
+{
+	uint32_t clock = uart_clock();
+
+	if (!uart_check_baudrate(baud)) {
+		return false;
+	}
+
+	while (!uart_tx_done())
+		;
+
+	usart_disable(usart);
+
+	if (baud <= clock / 16) {
+		USART_CR1(usart) &= ~UART_CR1_OVER8;
+		USART_BRR(usart) = (clock + baud / 2) / baud;
+
+	} else {
+		/* with OVER8 the low 4 bits of the divider are shifted down one */
+		uint32_t div = (2 * clock + baud / 2) / baud;
+
+		USART_CR1(usart) |= UART_CR1_OVER8;
+		USART_BRR(usart) = (div & 0xfff0) | ((div & 0xf) >> 1);
+	}
+
+	usart_set_flow_control(usart, flow_control ? USART_FLOWCONTROL_RTS_CTS : USART_FLOWCONTROL_NONE);
+	usart_enable(usart);
+
+	uart_baudrate = baud;
+	uart_flow_control = flow_control;
+	return true;
+}
+
+uint32_t
+uart_get_baudrate(void)
+{
+	return uart_baudrate;
+}
+
+bool
+uart_get_flow_control(void)
+{
+	return uart_flow_control;
+}
+
+#if defined(BOARD_BRIDGE_USART)
+/*
+ * The USART to the bootloader of a second MCU, for the PROTO_BRIDGE_
+ * commands. The board does pin and clock setup as for the interface.
+ */
+void
+bridge_cinit(void)
+{
+	usart_set_baudrate(BOARD_BRIDGE_USART, BRIDGE_BAUDRATE);
+	usart_set_databits(BOARD_BRIDGE_USART, 8);
+	usart_set_stopbits(BOARD_BRIDGE_USART, USART_STOPBITS_1);
+	usart_set_mode(BOARD_BRIDGE_USART, USART_MODE_TX_RX);
+	usart_set_parity(BOARD_BRIDGE_USART, USART_PARITY_NONE);
+	usart_set_flow_control(BOARD_BRIDGE_USART, USART_FLOWCONTROL_NONE);
+
+	usart_enable(BOARD_BRIDGE_USART);
+}
+
+void
+bridge_cfini(void)
+{
+	usart_disable(BOARD_BRIDGE_USART);
+}
+
+int
+bridge_cin(void)
+{
+	int c = -1;
+
+	if (USART_SR(BOARD_BRIDGE_USART) & USART_SR_RXNE) {
+		c = usart_recv(BOARD_BRIDGE_USART);
+	}
+
+	return c;
+}
+
+void
+bridge_cout(uint8_t *buf, unsigned len)
 {
 	while (len--) {
-		usart_send_blocking(usart, *buf++);
+		usart_send_blocking(BOARD_BRIDGE_USART, *buf++);
 	}
 }
+#endif